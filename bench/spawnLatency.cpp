@@ -0,0 +1,90 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Spawn latency of process launchers.
+    usage: spawn-latency [iterations] [ballast MiB] [threads]
+    Ballast is touched heap memory, it simulates loaded blobs and libgit2 caches,
+    fork() cost grows with it, posix_spawn() should not.
+*/
+
+#include "../process.h"
+#include "../log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    std::vector<double> measure(Launcher launcher, int iterations, int threadNum) {
+        std::vector<std::vector<double>> perThread(threadNum);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < threadNum; t++) {
+            threads.emplace_back([launcher, iterations, &samples = perThread[t]]() {
+                for (int i = 0; i < iterations; i++) {
+                    auto begin = Clock::now();
+                    auto process = createChildProcess(launcher);
+                    if (process->start("true", {"true"}, true)) {
+                        pumpProcess(*process, std::string());
+                    }
+                    process->wait();
+                    samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+                }
+            });
+        }
+        for (auto && thread : threads) {
+            thread.join();
+        }
+        std::vector<double> result;
+        for (auto && samples : perThread) {
+            result.insert(result.end(), samples.begin(), samples.end());
+        }
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    void report(const char * name, const std::vector<double> & samples) {
+        double sum = 0;
+        for (double sample : samples) {
+            sum += sample;
+        }
+        auto percentile = [&samples](double p) {
+            return samples[std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()))];
+        };
+        LogInfo(name, ": mean ", sum / samples.size(), "us, p50 ", percentile(0.5), "us, p99 ", percentile(0.99), "us");
+    }
+}
+
+int main(int argNum, char ** args) {
+    int iterations = argNum > 1 ? std::stoi(args[1]) : 200;
+    size_t ballastMiB = argNum > 2 ? std::stoul(args[2]) : 512;
+    int threadNum = argNum > 3 ? std::stoi(args[3]) : 1;
+
+    std::vector<char> ballast(ballastMiB << 20);
+    std::memset(ballast.data(), 1, ballast.size());
+    LogInfo("iterations: ", iterations, ", ballast: ", ballastMiB, "MiB, threads: ", threadNum);
+
+    report("pstreams", measure(Launcher::PSTREAMS, iterations, threadNum));
+    report("spawn   ", measure(Launcher::SPAWN, iterations, threadNum));
+    return ballast[ballast.size() / 2] == 1 ? 0 : 1;
+}
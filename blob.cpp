@@ -0,0 +1,92 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blob.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <cstring>
+#include <mutex>
+
+namespace {
+    std::mutex mappingMutex;
+}
+
+Blob::Blob(std::string_view content) : blobSize(content.size()) {
+#ifdef MFD_ALLOW_SEALING
+    fd = memfd_create("git-verify-blob", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+    if (fd >= 0) {
+        size_t written = 0;
+        while (written < content.size()) {
+            ssize_t n = ::write(fd, content.data() + written, content.size() - written);
+            if (n <= 0) {
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                LogErr("memfd write failed: ", std::strerror(errno));
+                ::close(fd);
+                fd = -1;
+                break;
+            }
+            written += n;
+        }
+    }
+    if (fd >= 0) {
+#ifdef F_SEAL_SEAL
+        ::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+    } else {
+        data = content;
+    }
+}
+
+Blob::~Blob() {
+    if (mapping) {
+        ::munmap(const_cast<char*>(mapping), blobSize);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+int Blob::openForRead() const {
+    if (fd < 0) {
+        return -1;
+    }
+    auto path = "/proc/self/fd/" + std::to_string(fd);
+    return ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+std::string_view Blob::view() const {
+    if (fd < 0 || blobSize == 0) {
+        return data;
+    }
+    std::lock_guard<std::mutex> lock(mappingMutex);
+    if (!mapping) {
+        void * address = ::mmap(nullptr, blobSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED) {
+            LogErr("memfd mmap failed: ", std::strerror(errno));
+            return std::string_view();
+        }
+        mapping = static_cast<const char*>(address);
+    }
+    return std::string_view(mapping, blobSize);
+}
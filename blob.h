@@ -0,0 +1,59 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+/**
+ * File content loaded once and shared by all tasks using it.
+ * Content is kept in sealed memfd, child processes get it as stdin without copies in this process.
+ * Without memfd support content is kept in memory.
+ */
+class Blob {
+    int fd = -1;
+    size_t blobSize = 0;
+    mutable const char * mapping = nullptr;
+    std::string data;   ///< content when memfd is not available
+public:
+    explicit Blob(std::string_view content);
+    ~Blob();
+    Blob(const Blob &) = delete;
+    Blob & operator=(const Blob &) = delete;
+
+    size_t size() const {
+        return blobSize;
+    }
+    /// new read only file description, with own offset, to use as child stdin
+    /// @return -1 if not supported, caller closes returned fd
+    int openForRead() const;
+    /// content mapped into memory on first use
+    std::string_view view() const;
+};
+
+using BlobPtr = std::shared_ptr<const Blob>;
+
+inline BlobPtr makeBlob(std::string_view content) {
+    return std::make_shared<const Blob>(content);
+}
+
+/// loads content when a task starts
+using BlobSource = std::function<BlobPtr()>;
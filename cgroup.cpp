@@ -0,0 +1,452 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "cgroup.h"
+#include "log.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <climits>
+#include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <vector>
+
+namespace {
+    std::mutex cgroupMutex;
+    std::atomic<bool> enabled{false};
+    /// not changed while enabled, so cleanup in signal handler reads them without allocation
+    std::string baseDir;        ///< cgroup of this process when started
+    std::string selfDir;        ///< leaf this process is moved to, parent of leaves cannot have processes
+    std::string tasksDir;       ///< parent of task type cgroups
+    std::string controllers;    ///< as written to cgroup.subtree_control
+    std::string disableControllers; ///< of base cgroup enabled by this run, as written to disable them
+    std::string pidText;
+    std::set<std::string> typeDirs;
+    std::atomic<unsigned> nextTaskId{0};
+    std::atomic<bool> limitsFailed{false};
+
+    bool writeFile(const std::string & path, const std::string & value) {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        bool written = ::write(fd, value.data(), value.size()) == static_cast<ssize_t>(value.size());
+        ::close(fd);
+        return written;
+    }
+
+    std::string readFile(const std::string & path) {
+        std::ifstream file(path);
+        std::stringstream content;
+        content << file.rdbuf();
+        return content.str();
+    }
+
+    /// mount point of cgroup2 file system, empty if not mounted
+    std::string cgroupMount() {
+        std::ifstream mountInfo("/proc/self/mountinfo");
+        std::string line;
+        while (std::getline(mountInfo, line)) {
+            // id parent major:minor root mountPoint options [optional fields] - fsType source superOptions
+            auto separator = line.find(" - ");
+            if (separator == std::string::npos || line.compare(separator + 3, 8, "cgroup2 ") != 0) {
+                continue;
+            }
+            std::istringstream fields(line);
+            std::string field, mountPoint;
+            fields >> field >> field >> field >> field >> mountPoint;
+            return mountPoint;
+        }
+        return {};
+    }
+
+    /// cgroup v2 path of this process, relative to mount point
+    std::string ownCgroup() {
+        std::ifstream cgroups("/proc/self/cgroup");
+        std::string line;
+        while (std::getline(cgroups, line)) {
+            if (line.rfind("0::", 0) == 0) {
+                return line.substr(3);
+            }
+        }
+        return {};
+    }
+
+    /// cgroup v1 directory of this process in hierarchy of controller, empty if not mounted
+    std::string v1Dir(const std::string & controller) {
+        auto hasItem = [](const std::string & list, const std::string & item) {
+            std::istringstream items(list);
+            std::string listItem;
+            while (std::getline(items, listItem, ',')) {
+                if (listItem == item) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        std::string path;
+        std::ifstream cgroups("/proc/self/cgroup");
+        std::string line;
+        while (std::getline(cgroups, line)) {
+            // id:controllers:path
+            auto first = line.find(':');
+            auto second = line.find(':', first + 1);
+            if (second != std::string::npos && hasItem(line.substr(first + 1, second - first - 1), controller)) {
+                path = line.substr(second + 1);
+            }
+        }
+        if (path.empty()) {
+            return {};
+        }
+        std::ifstream mountInfo("/proc/self/mountinfo");
+        while (std::getline(mountInfo, line)) {
+            auto separator = line.find(" - ");
+            if (separator == std::string::npos || line.compare(separator + 3, 7, "cgroup ") != 0) {
+                continue;
+            }
+            std::istringstream superFields(line.substr(separator + 3));
+            std::string fsType, source, options;
+            superFields >> fsType >> source >> options;
+            std::istringstream fields(line);
+            std::string field, root, mountPoint;
+            fields >> field >> field >> field >> root >> mountPoint;
+            // mount shows subtree of hierarchy starting at root, e.g. in container
+            if (!hasItem(options, controller) || path.rfind(root, 0) != 0) {
+                continue;
+            }
+            return mountPoint + (root == "/" ? path : path.substr(root.size()));
+        }
+        return {};
+    }
+
+    bool moveSelf(const std::string & dir) {
+        return writeFile(dir + "/cgroup.procs", std::to_string(::getpid()));
+    }
+
+    void applyLimits(const std::string & dir, const CgroupLimits & limits) {
+        bool applied = true;
+        if (limits.memoryMax.size()) {
+            applied &= writeFile(dir + "/memory.max", limits.memoryMax);
+            // limit is meant to protect from swapping, not to move task to swap
+            writeFile(dir + "/memory.swap.max", "0");
+        }
+        if (limits.cpuMax > 0) {
+            constexpr long period = 100000;
+            applied &= writeFile(dir + "/cpu.max", std::to_string(static_cast<long>(limits.cpuMax * period)) + " " + std::to_string(period));
+        }
+        if (!applied && !limitsFailed.exchange(true)) {
+            LogErr("cannot set cgroup limits in ", dir, ": ", std::strerror(errno));
+        }
+    }
+
+    void removeDir(const char * dir) {
+        // cgroup with exiting processes is busy for a moment
+        const timespec pause = {0, 5 * 1000 * 1000};
+        for (int i = 0; i < 20 && ::rmdir(dir) == -1 && errno == EBUSY; i++) {
+            ::nanosleep(&pause, nullptr);
+        }
+    }
+
+    void removeDir(const std::string & dir) {
+        removeDir(dir.c_str());
+    }
+
+    /// functions below are async-signal-safe, no allocation
+    bool joinPath(char (&out)[PATH_MAX], const char * dir, const char * name) {
+        size_t dirLength = std::strlen(dir);
+        size_t nameLength = std::strlen(name);
+        if (dirLength + 1 + nameLength >= PATH_MAX) {
+            return false;
+        }
+        std::memcpy(out, dir, dirLength);
+        out[dirLength] = '/';
+        std::memcpy(out + dirLength + 1, name, nameLength + 1);
+        return true;
+    }
+
+    bool writeIn(const char * dir, const char * name, const char * value) {
+        char path[PATH_MAX];
+        if (!joinPath(path, dir, name)) {
+            return false;
+        }
+        int fd = ::open(path, O_WRONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        size_t length = std::strlen(value);
+        bool written = ::write(fd, value, length) == static_cast<ssize_t>(length);
+        ::close(fd);
+        return written;
+    }
+
+    /// cgroup directories below dir are removed, depth first; control files are not removable and not needed to be
+    void removeSubtree(const char * dir, int depth) {
+        struct LinuxDirent64 {
+            ino64_t d_ino;
+            off64_t d_off;
+            unsigned short d_reclen;
+            unsigned char d_type;
+            char d_name[];
+        };
+        if (depth > 0) {
+            int fd = ::open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd >= 0) {
+                alignas(8) char buffer[4096];
+                long n;
+                while ((n = ::syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+                    for (long pos = 0; pos < n; ) {
+                        auto * entry = reinterpret_cast<LinuxDirent64 *>(buffer + pos);
+                        pos += entry->d_reclen;
+                        char path[PATH_MAX];
+                        if (entry->d_type == DT_DIR && std::strcmp(entry->d_name, ".") && std::strcmp(entry->d_name, "..")
+                            && joinPath(path, dir, entry->d_name)) {
+                            removeSubtree(path, depth - 1);
+                        }
+                    }
+                }
+                ::close(fd);
+            }
+        }
+        removeDir(dir);
+    }
+
+    void removeCgroups() {
+        // processes of tasks still running at exit
+        writeIn(tasksDir.c_str(), "cgroup.kill", "1");
+        // tasks dir / type / task
+        removeSubtree(tasksDir.c_str(), 2);
+        // base cgroup can have processes again when controllers are disabled
+        if (disableControllers.size()) {
+            writeIn(baseDir.c_str(), "cgroup.subtree_control", disableControllers.c_str());
+        }
+        if (writeIn(baseDir.c_str(), "cgroup.procs", pidText.c_str())) {
+            removeDir(selfDir);
+        }
+    }
+}
+
+double cgroupCpuQuota() {
+    double quota = 0;
+    auto limit = [&quota](double max, double period) {
+        if (max > 0 && period > 0 && (quota == 0 || max / period < quota)) {
+            quota = max / period;
+        }
+    };
+    auto mount = cgroupMount();
+    auto own = ownCgroup();
+    if (mount.size() && own.size()) {
+        // limit of any ancestor applies
+        for (auto path = own; ; path = path.substr(0, std::max<size_t>(path.rfind('/'), 1))) {
+            std::istringstream cpuMax(readFile(mount + path + "/cpu.max"));
+            std::string max;
+            double period = 0;
+            if (cpuMax >> max >> period && max != "max") {
+                limit(std::strtod(max.c_str(), nullptr), period);
+            }
+            if (path == "/") {
+                break;
+            }
+        }
+    }
+    auto v1 = v1Dir("cpu");
+    if (v1.size()) {
+        double max = std::strtod(readFile(v1 + "/cpu.cfs_quota_us").c_str(), nullptr);
+        double period = std::strtod(readFile(v1 + "/cpu.cfs_period_us").c_str(), nullptr);
+        limit(max, period);
+    }
+    return quota;
+}
+
+long cgroupMemoryAvailableKiB() {
+    long available = -1;
+    auto limit = [&available](const std::string & max, const std::string & current) {
+        char * end = nullptr;
+        double maxBytes = std::strtod(max.c_str(), &end);
+        if (end == max.c_str() || maxBytes <= 0 || maxBytes >= 1e18) {
+            // "max" or v1 "unlimited" as huge number
+            return;
+        }
+        double left = std::max(0.0, maxBytes - std::strtod(current.c_str(), nullptr)) / 1024;
+        if (available < 0 || left < available) {
+            available = static_cast<long>(left);
+        }
+    };
+    auto mount = cgroupMount();
+    auto own = ownCgroup();
+    if (mount.size() && own.size()) {
+        for (auto path = own; path != "/"; path = path.substr(0, std::max<size_t>(path.rfind('/'), 1))) {
+            limit(readFile(mount + path + "/memory.max"), readFile(mount + path + "/memory.current"));
+        }
+    }
+    auto v1 = v1Dir("memory");
+    if (v1.size()) {
+        limit(readFile(v1 + "/memory.limit_in_bytes"), readFile(v1 + "/memory.usage_in_bytes"));
+    }
+    return available;
+}
+
+std::string cpuPressureFile() {
+    auto mount = cgroupMount();
+    auto own = ownCgroup();
+    std::vector<std::string> files = {"/proc/pressure/cpu"};
+    if (mount.size() && own.size()) {
+        files.insert(files.begin(), mount + (own == "/" ? "" : own) + "/cpu.pressure");
+    }
+    for (auto && file : files) {
+        if (readFile(file).rfind("some ", 0) == 0) {
+            return file;
+        }
+    }
+    return {};
+}
+
+bool initCgroups() {
+    auto mount = cgroupMount();
+    auto own = ownCgroup();
+    if (mount.empty() || own.empty()) {
+        LogErr("cgroup v2 is not available, tasks run without limits");
+        return false;
+    }
+    baseDir = own == "/" ? mount : mount + own;
+    std::istringstream available(readFile(baseDir + "/cgroup.controllers"));
+    std::set<std::string> alreadyEnabled;
+    std::istringstream subtreeControl(readFile(baseDir + "/cgroup.subtree_control"));
+    std::string controller;
+    while (subtreeControl >> controller) {
+        alreadyEnabled.insert(controller);
+    }
+    std::string enableControllers;
+    while (available >> controller) {
+        if (controller == "memory" || controller == "cpu") {
+            controllers += (controllers.empty() ? "+" : " +") + controller;
+            // controllers enabled before the run are left enabled
+            if (!alreadyEnabled.count(controller)) {
+                enableControllers += (enableControllers.empty() ? "+" : " +") + controller;
+                disableControllers += (disableControllers.empty() ? "-" : " -") + controller;
+            }
+        }
+    }
+    if (controllers.empty()) {
+        LogErr("memory and cpu cgroup controllers are not delegated to ", baseDir, ", tasks run without limits");
+        return false;
+    }
+    const std::string prefix = baseDir + "/git-verify-" + std::to_string(::getpid());
+    selfDir = prefix;
+    tasksDir = prefix + "-tasks";
+    if (::mkdir(selfDir.c_str(), 0755) == -1) {
+        LogErr("cannot create cgroup ", selfDir, ": ", std::strerror(errno), ", tasks run without limits");
+        return false;
+    }
+    if (!moveSelf(selfDir)) {
+        LogErr("cannot join cgroup ", selfDir, ": ", std::strerror(errno), ", tasks run without limits");
+        ::rmdir(selfDir.c_str());
+        return false;
+    }
+    // fails when other processes are left in base cgroup, it is not delegated to git-verify only
+    if ((enableControllers.size() && !writeFile(baseDir + "/cgroup.subtree_control", enableControllers))
+        || ::mkdir(tasksDir.c_str(), 0755) == -1
+        || !writeFile(tasksDir + "/cgroup.subtree_control", controllers)) {
+        LogErr("cannot enable cgroup controllers in ", baseDir, ": ", std::strerror(errno), ", tasks run without limits");
+        ::rmdir(tasksDir.c_str());
+        if (disableControllers.size()) {
+            writeFile(baseDir + "/cgroup.subtree_control", disableControllers);
+        }
+        moveSelf(baseDir);
+        ::rmdir(selfDir.c_str());
+        return false;
+    }
+    LogDev("cgroups in ", baseDir, ": ", controllers);
+    pidText = std::to_string(::getpid());
+    enabled = true;
+    // also on std::exit() paths
+    std::atexit(finishCgroups);
+    return true;
+}
+
+void finishCgroups() {
+    std::lock_guard<std::mutex> lock(cgroupMutex);
+    if (enabled.exchange(false)) {
+        removeCgroups();
+    }
+}
+
+void finishCgroupsOnSignal() {
+    if (enabled.exchange(false)) {
+        removeCgroups();
+    }
+}
+
+TaskCgroup::~TaskCgroup() {
+    // descendants left by task
+    writeFile(dir + "/cgroup.kill", "1");
+    removeDir(dir);
+}
+
+bool TaskCgroup::oomKilled() const {
+    std::istringstream events(readFile(dir + "/memory.events"));
+    std::string name;
+    long count = 0;
+    while (events >> name >> count) {
+        if (name == "oom_kill") {
+            return count > 0;
+        }
+    }
+    return false;
+}
+
+TaskCgroupPtr createTaskCgroup(const std::string & typeName, const CgroupLimits & limits) {
+    if (limits.empty()) {
+        return nullptr;
+    }
+    std::string typeDir;
+    {
+        std::lock_guard<std::mutex> lock(cgroupMutex);
+        if (!enabled) {
+            return nullptr;
+        }
+        auto name = typeName;
+        std::replace(name.begin(), name.end(), '/', '_');
+        typeDir = tasksDir + "/" + name;
+        if (typeDirs.insert(typeDir).second) {
+            ::mkdir(typeDir.c_str(), 0755);
+            writeFile(typeDir + "/cgroup.subtree_control", controllers);
+            if (limits.perType) {
+                applyLimits(typeDir, limits);
+            }
+        }
+    }
+    auto dir = typeDir + "/" + std::to_string(nextTaskId++);
+    if (::mkdir(dir.c_str(), 0755) == -1) {
+        LogErr("cannot create cgroup ", dir, ": ", std::strerror(errno));
+        return nullptr;
+    }
+    if (!limits.perType) {
+        applyLimits(dir, limits);
+    }
+    return std::make_unique<TaskCgroup>(dir);
+}
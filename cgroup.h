@@ -0,0 +1,70 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+/// cgroup v2 limits of task processes
+struct CgroupLimits {
+    std::string memoryMax;  ///< memory.max value as "512M", empty - no limit
+    double cpuMax = 0;      ///< CPUs, 0 - no limit
+    bool perType = false;   ///< limits are shared by all running tasks of type instead of each task
+    bool empty() const {
+        return memoryMax.empty() && cpuMax <= 0;
+    }
+};
+
+/**
+ * Create git-verify cgroup subtree in cgroup of this process and move this process to its leaf.
+ * Requires delegated cgroup v2 subtree, e.g. `systemd-run --user --scope -p Delegate=yes`.
+ * @return false when not available, tasks run without limits then
+ */
+bool initCgroups();
+/// move this process back, remove created cgroups and disable controllers enabled by initCgroups(), also called at exit
+void finishCgroups();
+/// as finishCgroups() with processes of tasks killed, async-signal-safe, for handler of terminating signal
+void finishCgroupsOnSignal();
+
+/// CPUs allowed by cpu.max of cgroup of this process and its ancestors (or cgroup v1 CFS quota), 0 - no quota
+double cgroupCpuQuota();
+/// KiB left below memory.max of cgroup of this process and its ancestors (or cgroup v1 limit), -1 - no limit
+long cgroupMemoryAvailableKiB();
+/// cpu.pressure of cgroup of this process, /proc/pressure/cpu without it, empty if PSI is not available
+std::string cpuPressureFile();
+
+/// cgroup of one task, removed with its remaining processes on destruction
+class TaskCgroup {
+    std::string dir;
+public:
+    explicit TaskCgroup(std::string dir) : dir(std::move(dir)) {}
+    ~TaskCgroup();
+    TaskCgroup(const TaskCgroup &) = delete;
+    TaskCgroup & operator=(const TaskCgroup &) = delete;
+    const std::string & path() const {
+        return dir;
+    }
+    /// process of task was killed by OOM killer
+    bool oomKilled() const;
+};
+
+using TaskCgroupPtr = std::unique_ptr<TaskCgroup>;
+
+/// @return nullptr when limits are empty or cgroups are not initialized
+TaskCgroupPtr createTaskCgroup(const std::string & typeName, const CgroupLimits & limits);
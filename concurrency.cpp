@@ -0,0 +1,203 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "concurrency.h"
+#include "cgroup.h"
+#include "process.h"
+
+#include <sched.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+namespace {
+    unsigned tasksInParallel = 0;
+
+    /// percents, PSI "some avg10" or load average per CPU
+    constexpr double highPsi = 40;
+    constexpr double lowPsi = 10;
+    constexpr double highLoad = 150;
+    constexpr double lowLoad = 100;
+
+    unsigned affinityCpus() {
+        for (int size = 1024; size <= 65536; size *= 2) {
+            cpu_set_t * set = CPU_ALLOC(size);
+            size_t bytes = CPU_ALLOC_SIZE(size);
+            CPU_ZERO_S(bytes, set);
+            int count = ::sched_getaffinity(0, bytes, set) == 0 ? CPU_COUNT_S(bytes, set) : 0;
+            CPU_FREE(set);
+            if (count > 0) {
+                return count;
+            }
+            if (errno != EINVAL) {
+                break;
+            }
+        }
+        return std::max(std::thread::hardware_concurrency(), 1u);
+    }
+}
+
+long availableMemoryKiB() {
+    std::ifstream memInfo("/proc/meminfo");
+    std::string name;
+    long value = 0;
+    std::string unit;
+    long available = -1;
+    while (memInfo >> name >> value >> unit) {
+        if (name == "MemAvailable:") {
+            available = value;
+            break;
+        }
+    }
+    long cgroupAvailable = cgroupMemoryAvailableKiB();
+    if (cgroupAvailable >= 0 && (available < 0 || cgroupAvailable < available)) {
+        available = cgroupAvailable;
+    }
+    return available;
+}
+
+unsigned availableCpus() {
+    unsigned cpus = affinityCpus();
+    double quota = cgroupCpuQuota();
+    if (quota > 0) {
+        cpus = std::min(cpus, static_cast<unsigned>(std::ceil(quota)));
+    }
+    return std::max(cpus, 1u);
+}
+
+void setConcurrency(unsigned tasks) {
+    tasksInParallel = std::max(tasks, 1u);
+}
+
+unsigned concurrency() {
+    if (!tasksInParallel) {
+        tasksInParallel = availableCpus();
+    }
+    return tasksInParallel;
+}
+
+LoadThrottle::LoadThrottle(unsigned maxRunning)
+    : maxRunning(std::max(maxRunning, 1u)), limit(this->maxRunning), pressureFile(cpuPressureFile()) {
+    // share of CPU time already taken by others
+    double current = pressure();
+    if (current > 0) {
+        double free = pressureFile.size() ? (100 - current) / 100 : std::min(1.0, 100 / current);
+        limit = std::clamp(static_cast<unsigned>(std::ceil(this->maxRunning * free)), 1u, this->maxRunning);
+    }
+    monitor = std::thread(&LoadThrottle::watch, this);
+}
+
+LoadThrottle::~LoadThrottle() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    monitor.join();
+}
+
+double LoadThrottle::pressure() const {
+    if (pressureFile.size()) {
+        // some avg10=1.23 avg60=0.50 avg300=0.10 total=12345
+        std::ifstream file(pressureFile);
+        std::string kind, avg10;
+        if (file >> kind >> avg10 && avg10.rfind("avg10=", 0) == 0) {
+            return std::strtod(avg10.c_str() + 6, nullptr);
+        }
+        return -1;
+    }
+    std::ifstream loadAvg("/proc/loadavg");
+    double load = 0;
+    if (!(loadAvg >> load)) {
+        return -1;
+    }
+    // load of whole system, not only of CPUs of this process
+    long cpus = ::sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? load * 100 / cpus : -1;
+}
+
+void LoadThrottle::watch() {
+    double high = pressureFile.size() ? highPsi : highLoad;
+    double low = pressureFile.size() ? lowPsi : lowLoad;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!changed.wait_for(lock, std::chrono::seconds(1), [this]{ return stopping; })) {
+        lock.unlock();
+        double current = pressure();
+        lock.lock();
+        if (current < 0) {
+            continue;
+        }
+        if (current > high && limit > 1) {
+            limit--;
+        } else if (current < low && limit < maxRunning) {
+            limit++;
+            changed.notify_all();
+        }
+    }
+}
+
+bool LoadThrottle::acquire(unsigned slots) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (running && running + slots > limit) {
+        if (processesCancelled()) {
+            return false;
+        }
+        changed.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    running += slots;
+    return true;
+}
+
+void LoadThrottle::release(unsigned slots) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running -= slots;
+    }
+    changed.notify_all();
+}
+
+bool MemoryBudget::admit(long memoryKiB, double priority, Retry retry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (budgetKiB >= 0 && usedKiB > 0 && usedKiB + memoryKiB > budgetKiB) {
+        deferred.push_back({priority, std::move(retry)});
+        return false;
+    }
+    usedKiB += memoryKiB;
+    return true;
+}
+
+std::vector<MemoryBudget::Retry> MemoryBudget::release(long memoryKiB) {
+    std::vector<Deferred> released;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        usedKiB -= memoryKiB;
+        released.swap(deferred);
+    }
+    std::stable_sort(released.begin(), released.end(), [](const Deferred & a, const Deferred & b) {
+        return a.priority > b.priority;
+    });
+    std::vector<Retry> retry;
+    for (auto && item : released) {
+        retry.push_back(std::move(item.retry));
+    }
+    return retry;
+}
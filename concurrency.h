@@ -0,0 +1,92 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// CPUs usable by this process: sched_getaffinity mask limited by cgroup CPU quota, at least 1
+unsigned availableCpus();
+
+/// MemAvailable of /proc/meminfo limited by cgroup memory limit, KiB, -1 if unknown
+long availableMemoryKiB();
+
+/// tasks run in parallel, set at start by -j or from availableCpus()
+void setConcurrency(unsigned tasks);
+unsigned concurrency();
+
+/**
+ * Limit of running tasks, lowered while CPU pressure (PSI, or load average without it) is high
+ * and raised back to the maximum when it drops. Checked every second by own thread.
+ */
+class LoadThrottle {
+    const unsigned maxRunning;
+    unsigned limit;
+    unsigned running = 0;
+    bool stopping = false;
+    std::string pressureFile;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread monitor;
+
+    /// @return percent of time runnable tasks waited for CPU in last 10 s, or load average per CPU in percent, -1 if unknown
+    double pressure() const;
+    void watch();
+public:
+    explicit LoadThrottle(unsigned maxRunning);
+    ~LoadThrottle();
+    LoadThrottle(const LoadThrottle &) = delete;
+    LoadThrottle & operator=(const LoadThrottle &) = delete;
+
+    /// block until task using slots may start, task with more slots than limit runs alone
+    /// @return false when processes are cancelled
+    bool acquire(unsigned slots = 1);
+    void release(unsigned slots = 1);
+};
+
+/**
+ * Admission of tasks by expected peak memory. Task which does not fit waits outside of the executor,
+ * so lighter tasks start in the meantime, and it is admitted again when other task releases its memory.
+ * One budget is shared by all runs running at once.
+ */
+class MemoryBudget {
+public:
+    using Retry = std::function<void()>;
+private:
+    struct Deferred {
+        double priority;
+        Retry retry;
+    };
+    const long budgetKiB;
+    long usedKiB = 0;
+    std::vector<Deferred> deferred;
+    std::mutex mutex;
+public:
+    /// @param budgetKiB -1 - no limit
+    explicit MemoryBudget(long budgetKiB) : budgetKiB(budgetKiB) {}
+    /// task always fits when no other task is admitted
+    /// @return false when task is deferred, its retry is returned by later release()
+    bool admit(long memoryKiB, double priority, Retry retry);
+    /// @return retries of deferred tasks, the highest priority first
+    std::vector<Retry> release(long memoryKiB);
+};
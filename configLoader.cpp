@@ -24,6 +24,7 @@
 #include <variant>
 #include <yaml-cpp/yaml.h>
 #include <filesystem>
+#include <regex>
 
 namespace YAML {
     template <> struct convert <TaskType::TargetType> {
@@ -52,6 +53,24 @@ namespace YAML {
             return true;
         }
     };
+    template <> struct convert <TaskType::Type> {
+        static bool decode (const Node & node, TaskType::Type & type) {
+            if ( !node.IsScalar() ) {
+                LogErr(R"("type" node is not "Scalar".)");
+                return false;
+            }
+            auto typeName = node.as<std::string>();
+            if ( typeName == "PROCESS" ) {
+                type = TaskType::Type::PROCESS;
+            } else if ( typeName == "WORKER" ) {
+                type = TaskType::Type::WORKER;
+            } else {
+                LogErr(R"("type" unknown value.)");
+                return false;
+            }
+            return true;
+        }
+    };
     template <> struct convert <TestType> {
         static bool decode (const Node & node, TestType & type) {
             if ( !node.IsScalar() ) {
@@ -85,6 +104,8 @@ namespace YAML {
             auto specialName = node.as<std::string>();
             if (specialName == "FILENAME") {
                 special = TaskType::Process::Special::FILENAME;
+            } else if (specialName == "FILENAMES") {
+                special = TaskType::Process::Special::FILENAMES;
             } else {
                 LogErr(R"("special" unknown value.)");
                 return false;
@@ -173,6 +194,38 @@ namespace YAML {
             LogDev("loader - useStdin ", process.useStdin ? 1: 0);
             process.skipOnEmptyFile = node["skipOnEmptyFile"].as<bool>(true);
             process.executable = node["executable"].as<std::string>();
+            process.workers = node["workers"].as<unsigned>(0);
+            process.batchSize = node["batchSize"].as<unsigned>(0);
+            process.responseFile = node["responseFile"].as<std::string>("");
+            process.timeout = node["timeout"].as<double>(0);
+            process.slots = node["slots"].as<unsigned>(0);
+            if (process.timeout < 0) {
+                LogErr(R"("process.timeout" cannot be negative.)");
+                return false;
+            }
+            process.cgroupLimits.memoryMax = node["memoryMax"].as<std::string>("");
+            if (process.cgroupLimits.memoryMax.size() && !std::regex_match(process.cgroupLimits.memoryMax, std::regex("max|[0-9]+[KMGT]?"))) {
+                LogErr(R"("process.memoryMax" must be bytes with optional K, M, G or T suffix.)");
+                return false;
+            }
+            process.cgroupLimits.cpuMax = node["cpuMax"].as<double>(0);
+            if (process.cgroupLimits.cpuMax < 0) {
+                LogErr(R"("process.cpuMax" cannot be negative.)");
+                return false;
+            }
+            process.cgroupLimits.perType = node["limitPerType"].as<bool>(false);
+            if (process.isBatch()) {
+                for (auto && param : process.params) {
+                    if (param.index() == 1 && std::get<TaskType::Process::Special>(param) == TaskType::Process::Special::FILENAME) {
+                        LogErr(R"("process.params" cannot mix "FILENAME" and "FILENAMES".)");
+                        return false;
+                    }
+                }
+                if (process.useStdin || process.testType == TestType::DIFF) {
+                    LogErr(R"("FILENAMES" forbids "useStdin" and testType = "DIFF".)");
+                    return false;
+                }
+            }
             if (process.testType == TestType::DIFF || process.testType == TestType::DIFF_WITH_CHECKOUT) {
                 if (!node["logDiffFilterRegex"]) {
                     LogErr(R"(process.testType = "DIFF" require "logDiffFilterRegex" field)");
@@ -224,12 +277,48 @@ namespace YAML {
                 }
                 taskType.file = node["file"].as<TaskType::File>();
             }
+            taskType.type = node["type"].as<TaskType::Type>();
             if (! node["process"]) {
-                LogErr(R"(Task definition of type = "PROCESS" require "process" field)");
+                LogErr(R"(Task definition of type in ("PROCESS", "WORKER") require "process" field)");
                 return false;
             }
             taskType.process = node["process"].as<TaskType::Process>();
+            if (taskType.process.isBatch() && (taskType.type != TaskType::Type::PROCESS
+                    || (taskType.targetType != TargetType::FILE && taskType.targetType != TargetType::FILE_NAME))) {
+                LogErr(R"("FILENAMES" require type = "PROCESS" and targetType in ("FILE", "FILE_NAME"))");
+                return false;
+            }
+            if (taskType.type == TaskType::Type::WORKER) {
+                if (taskType.targetType != TargetType::FILE && taskType.targetType != TargetType::FILE_NAME && taskType.targetType != TargetType::ADDED_TEXT) {
+                    LogErr(R"(Task definition of type = "WORKER" require targetType in ("FILE", "FILE_NAME", "ADDED_TEXT"))");
+                    return false;
+                }
+                if (!taskType.process.useStdin || taskType.process.testType == TestType::DIFF_WITH_CHECKOUT) {
+                    LogErr(R"(Task definition of type = "WORKER" require "useStdin" and forbids testType = "DIFF_WITH_CHECKOUT")");
+                    return false;
+                }
+                for (auto && param : taskType.process.params) {
+                    if (param.index() == 1) {
+                        LogErr(R"(Task definition of type = "WORKER" forbids "special" params, file name is sent in request)");
+                        return false;
+                    }
+                }
+            }
             taskType.enabled = node["enabled"].as<bool>(true);
+            if (node["dependsOn"]) {
+                if (!node["dependsOn"].IsSequence()) {
+                    LogErr(R"("dependsOn" is not list of task names.)");
+                    return false;
+                }
+                taskType.dependsOn = node["dependsOn"].as<std::vector<std::string>>();
+            }
+            if (node["needsWorktree"]) {
+                if (taskType.targetType == TargetType::BUILD) {
+                    LogErr(R"(Task definition of targetType = "BUILD" forbids "needsWorktree")");
+                    return false;
+                }
+                taskType.needsWorktree = node["needsWorktree"].as<bool>();
+            }
             return true;
         }
     };
@@ -19,6 +19,7 @@
 #pragma once
 
 #include "common.h"
+#include "cgroup.h"
 
 #include <vector>
 #include <optional>
@@ -34,6 +35,7 @@ struct TaskType {
     struct Process {
         enum class Special {
             FILENAME,
+            FILENAMES,  ///< all files of batch
         };
         std::vector<std::variant<std::string, Special>> params;
         std::string executable;
@@ -43,6 +45,24 @@ struct TaskType {
         TestType testType;
         bool useStdin;
         bool skipOnEmptyFile;
+        unsigned workers;   ///< for Type::WORKER, 0 - one per hardware thread
+        unsigned batchSize; ///< max files for Special::FILENAMES, 0 - limited by ARG_MAX only
+        std::string responseFile;   ///< param prefix for file with file names when ARG_MAX is exceeded, empty - split batch
+        double timeout;     ///< seconds until process group is killed, 0 - no limit
+        CgroupLimits cgroupLimits;  ///< applied with --cgroups
+        unsigned slots;     ///< parallel task slots used by tool, 0 - one, not exported
+        bool isBatch() const {
+            for (auto && param : params) {
+                if (param.index() == 1 && std::get<Special>(param) == Special::FILENAMES) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+    enum class Type {
+        PROCESS,
+        WORKER,
     };
     enum class TargetType {
         FILE,
@@ -56,8 +76,11 @@ struct TaskType {
     std::string description;
     std::optional<File> file;
     Process process;
+    Type type;
     TargetType targetType;
     bool enabled;
+    std::optional<std::vector<std::string>> dependsOn;  ///< task types finished before tasks of this type start, default - all BUILD types for other types needing worktree
+    std::optional<bool> needsWorktree;  ///< tool reads checked out files, default - all but stdin fed tools of file content and commit text
 };
 
 using TaskTypesMap = std::map<std::string, TaskType>;
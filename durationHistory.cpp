@@ -0,0 +1,164 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "durationHistory.h"
+#include "log.h"
+
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+namespace {
+    const char * header = "# git-verify task durations v2";
+    /// oldest entries above it are dropped on save
+    constexpr size_t maxEntries = 10000;
+    /// weight of last run in moving average
+    constexpr double lastRunWeight = 0.5;
+    /// start of process costs about as much as reading this many bytes
+    constexpr double fixedCostBytes = 64 * 1024;
+
+    bool storable(const std::string & text) {
+        return text.find_first_of("\t\n") == std::string::npos;
+    }
+}
+
+DurationHistory::DurationHistory(std::string fileName) : fileName(std::move(fileName)) {
+    if (this->fileName.empty()) {
+        return;
+    }
+    std::ifstream file(this->fileName);
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream lineStream(line);
+        std::string type, path, inputSize, seconds, lastRun, maxRss;
+        if (!std::getline(lineStream, type, '\t') || !std::getline(lineStream, path, '\t')
+            || !std::getline(lineStream, inputSize, '\t') || !std::getline(lineStream, seconds, '\t')
+            || !std::getline(lineStream, lastRun, '\t')) {
+            continue;
+        }
+        // not in files of older versions
+        std::getline(lineStream, maxRss);
+        Entry entry;
+        char * end = nullptr;
+        entry.inputSize = std::strtoull(inputSize.c_str(), &end, 10);
+        bool valid = *end == '\0';
+        entry.seconds = std::strtod(seconds.c_str(), &end);
+        valid = valid && *end == '\0' && entry.seconds >= 0;
+        entry.lastRun = std::strtoll(lastRun.c_str(), &end, 10);
+        valid = valid && *end == '\0';
+        entry.maxRssKiB = std::strtol(maxRss.c_str(), &end, 10);
+        if (!valid || *end) {
+            // damaged line, it will be rewritten by next save
+            continue;
+        }
+        entries[{type, path}] = entry;
+    }
+    for (auto && item : entries) {
+        for (auto * totals : {&typeTotals[item.first.first], &allTotals}) {
+            totals->seconds += item.second.seconds;
+            totals->inputSize += item.second.inputSize;
+            totals->count++;
+            totals->maxRssKiB = std::max(totals->maxRssKiB, item.second.maxRssKiB);
+        }
+    }
+}
+
+double DurationHistory::scaled(const Totals & totals, size_t inputSize) {
+    if (totals.count == 0) {
+        return 0;
+    }
+    double seconds = totals.seconds / totals.count;
+    double size = totals.inputSize / totals.count;
+    return seconds * (inputSize + fixedCostBytes) / (size + fixedCostBytes);
+}
+
+double DurationHistory::estimate(const TaskRunDescription & descr) const {
+    auto entryIt = entries.find({descr.taskTypeName, descr.fileName});
+    if (entryIt != entries.end()) {
+        return scaled(Totals{entryIt->second.seconds, static_cast<double>(entryIt->second.inputSize), 1, 0}, descr.inputSize);
+    }
+    auto typeIt = typeTotals.find(descr.taskTypeName);
+    return scaled(typeIt != typeTotals.end() ? typeIt->second : allTotals, descr.inputSize);
+}
+
+long DurationHistory::expectedMemoryKiB(const TaskRunDescription & descr) const {
+    auto entryIt = entries.find({descr.taskTypeName, descr.fileName});
+    if (entryIt != entries.end()) {
+        return entryIt->second.maxRssKiB;
+    }
+    auto typeIt = typeTotals.find(descr.taskTypeName);
+    return typeIt != typeTotals.end() ? typeIt->second.maxRssKiB : 0;
+}
+
+void DurationHistory::record(const TaskRunDescription & descr, double seconds, long maxRssKiB) {
+    if (fileName.empty() || !storable(descr.taskTypeName) || !storable(descr.fileName)) {
+        return;
+    }
+    auto inserted = entries.emplace(std::make_pair(descr.taskTypeName, descr.fileName), Entry());
+    auto & entry = inserted.first->second;
+    entry.seconds = inserted.second ? seconds : entry.seconds * (1 - lastRunWeight) + seconds * lastRunWeight;
+    entry.maxRssKiB = std::max(maxRssKiB, (entry.maxRssKiB + maxRssKiB) / 2);
+    entry.inputSize = descr.inputSize;
+    entry.lastRun = std::time(nullptr);
+    changed = true;
+}
+
+bool DurationHistory::save() {
+    if (fileName.empty() || !changed) {
+        return true;
+    }
+    using EntryRef = decltype(entries)::const_iterator;
+    std::vector<EntryRef> kept;
+    for (auto it = entries.cbegin(); it != entries.cend(); ++it) {
+        kept.push_back(it);
+    }
+    if (kept.size() > maxEntries) {
+        std::nth_element(kept.begin(), kept.begin() + maxEntries, kept.end(), [](EntryRef a, EntryRef b) {
+            return a->second.lastRun > b->second.lastRun;
+        });
+        kept.resize(maxEntries);
+    }
+    // concurrent runs replace whole file, the last one wins
+    std::string tmpName = fileName + ".tmp." + std::to_string(::getpid());
+    {
+        std::ofstream file(tmpName, std::ios::trunc);
+        file << header << '\n';
+        for (auto && it : kept) {
+            file << it->first.first << '\t' << it->first.second << '\t' << it->second.inputSize << '\t'
+                 << it->second.seconds << '\t' << it->second.lastRun << '\t' << it->second.maxRssKiB << '\n';
+        }
+        if (!file.flush()) {
+            std::remove(tmpName.c_str());
+            return false;
+        }
+    }
+    if (std::rename(tmpName.c_str(), fileName.c_str()) != 0) {
+        std::remove(tmpName.c_str());
+        return false;
+    }
+    changed = false;
+    return true;
+}
@@ -0,0 +1,70 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "taskBase.h"
+
+#include <map>
+#include <string>
+#include <utility>
+
+/**
+ * Wall time and peak memory of tasks in earlier runs, kept in a small tab separated file in git directory.
+ * Used to start the longest tasks first, so the slowest one does not run alone at the end,
+ * and to start only tasks whose memory fits.
+ */
+class DurationHistory {
+    struct Entry {
+        size_t inputSize = 0;   ///< of last run
+        double seconds = 0;     ///< moving average
+        long long lastRun = 0;  ///< unix time, least recently run entries are dropped first
+        long maxRssKiB = 0;     ///< follows growth at once, decreases slowly
+    };
+    struct Totals {
+        double seconds = 0;
+        double inputSize = 0;
+        size_t count = 0;
+        long maxRssKiB = 0;     ///< largest of entries
+    };
+    std::string fileName;
+    std::map<std::pair<std::string, std::string>, Entry> entries;   ///< by task type and path
+    std::map<std::string, Totals> typeTotals;   ///< of loaded entries
+    Totals allTotals;
+    bool changed = false;
+
+    static double scaled(const Totals & totals, size_t inputSize);
+public:
+    /// without file name nothing is loaded nor saved
+    explicit DurationHistory(std::string fileName = std::string());
+
+    /**
+     * Expected wall time: history of the same task scaled by input size,
+     * for new tasks average of task type (or of all tasks) scaled by input size.
+     * @return 0 if history is empty
+     */
+    double estimate(const TaskRunDescription & descr) const;
+    /**
+     * Expected peak memory: history of the same task, for new tasks the largest of task type.
+     * @return 0 if unknown
+     */
+    long expectedMemoryKiB(const TaskRunDescription & descr) const;
+    void record(const TaskRunDescription & descr, double seconds, long maxRssKiB);
+    /// @return false if file cannot be written
+    bool save();
+};
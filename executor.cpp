@@ -0,0 +1,113 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "executor.h"
+
+#include <algorithm>
+
+namespace {
+    thread_local const Executor * currentExecutor = nullptr;
+    thread_local unsigned currentIndex = 0;
+}
+
+Executor::Executor(unsigned threadNum) {
+    threadNum = std::max(threadNum, 1u);
+    for (unsigned i = 0; i < threadNum; i++) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    for (unsigned i = 0; i < threadNum; i++) {
+        threads.emplace_back(&Executor::work, this, i);
+    }
+}
+
+Executor::~Executor() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto && thread : threads) {
+        thread.join();
+    }
+}
+
+void Executor::submit(Job job) {
+    auto & queue = currentExecutor == this ? *queues[currentIndex] : injected;
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.jobs.push_back(std::move(job));
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        unfinished++;
+        queued++;
+    }
+    wake.notify_one();
+}
+
+void Executor::wait() {
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    idle.wait(lock, [this]{ return unfinished == 0; });
+}
+
+bool Executor::take(unsigned index, Job & job) {
+    {
+        auto & own = *queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (own.jobs.size()) {
+            job = std::move(own.jobs.back());
+            own.jobs.pop_back();
+            queued--;
+            return true;
+        }
+    }
+    // jobs from outside first, then the oldest jobs of other threads
+    for (size_t i = 0; i < queues.size(); i++) {
+        auto & victim = i ? *queues[(index + i) % queues.size()] : injected;
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.jobs.size()) {
+            job = std::move(victim.jobs.front());
+            victim.jobs.pop_front();
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Executor::work(unsigned index) {
+    currentExecutor = this;
+    currentIndex = index;
+    while (true) {
+        Job job;
+        if (take(index, job)) {
+            job();
+            job = nullptr;
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            if (--unfinished == 0) {
+                idle.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wake.wait(lock, [this]{ return stopping || queued > 0; });
+        if (stopping && queued <= 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,68 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Work-stealing thread pool shared by all phases of the run.
+ * Every thread owns a deque: it takes own jobs from the back (follow-ups run next, while their data is warm),
+ * then jobs submitted from outside in submission order, idle threads steal the oldest jobs from the front of other deques.
+ */
+class Executor {
+public:
+    using Job = std::function<void()>;
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+    std::vector<std::unique_ptr<Queue>> queues;
+    Queue injected;     ///< submitted from outside of the executor, kept in order
+    std::vector<std::thread> threads;
+    std::atomic<long> queued{0};    ///< jobs in deques, briefly negative while job is pushed
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    size_t unfinished = 0;          ///< submitted and not finished jobs, guarded by sleepMutex
+    bool stopping = false;
+
+    void work(unsigned index);
+    bool take(unsigned index, Job & job);
+public:
+    explicit Executor(unsigned threadNum);
+    ~Executor();
+    Executor(const Executor &) = delete;
+    Executor & operator=(const Executor &) = delete;
+
+    /// from job of this executor the job goes to the local deque, otherwise jobs start in submission order
+    void submit(Job job);
+    /// block until all submitted jobs, including their follow-ups, are finished
+    void wait();
+    unsigned size() const {
+        return threads.size();
+    }
+};
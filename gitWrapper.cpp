@@ -20,10 +20,13 @@
 #include "gitWrapper.h"
 #include <git2.h>
 
+#include <exception>
+#include <utility>
+
 namespace {
     struct FileCbPayload {
-        Messages & msgs;
-        std::vector<std::string> & newFiles;
+        std::function<void(const git_diff_delta &)> onDelta;
+        std::exception_ptr error;   ///< not thrown through libgit2
     };
     struct LogDiffCbPayload {
         std::vector<int> & addedLines;
@@ -35,8 +38,12 @@ namespace {
             return 0;
         }
         auto * payload = static_cast<FileCbPayload*>(payloadVoid);
-        payload->msgs.push_back({MessageType::NORMAL, delta->new_file.path});
-        payload->newFiles.push_back(delta->new_file.path);
+        try {
+            payload->onDelta(*delta);
+        } catch (...) {
+            payload->error = std::current_exception();
+            return -1;
+        }
         return 0;
     }
     int logDiff_line_cb(const git_diff_delta * delta, const git_diff_hunk *hunk, const git_diff_line *line, void * payloadVoid) {
@@ -62,17 +69,33 @@ namespace {
         return diffopts;
     }
 
+    std::string hexId(const git_oid & id) {
+        if (git_oid_iszero(&id)) {
+            return std::string();
+        }
+        char hex[GIT_OID_HEXSZ + 1];
+        return std::string(git_oid_tostr(hex, sizeof(hex), &id));
+    }
+
     struct getAddedLines_payload {
-        const std::string & fileName;
-        std::string & result;
+        std::map<std::string, AddedLines> & result;
+        /// lines of one file come together, path is looked up once per file
+        const git_diff_delta * lastDelta = nullptr;
+        AddedLines * lastFile = nullptr;
     };
     
     int getAddedLines_line_cb(const git_diff_delta * delta, const git_diff_hunk * unusedHunk, const git_diff_line * line, void * payloadRaw) {
         (void) unusedHunk;
         getAddedLines_payload * payload = (getAddedLines_payload*)(payloadRaw);
-        if (delta->new_file.path == payload->fileName && line->origin == '+') {
-            payload->result += std::string(line->content, line->content_len);
+        if (line->origin != '+') {
+            return 0;
+        }
+        if (delta != payload->lastDelta) {
+            payload->lastDelta = delta;
+            payload->lastFile = &payload->result[delta->new_file.path];
         }
+        payload->lastFile->text.append(line->content, line->content_len);
+        payload->lastFile->lineNumbers.push_back(line->new_lineno);
         return 0;
     }
 }
@@ -88,82 +111,124 @@ GitWrapper::~GitWrapper() {
     git_libgit2_shutdown();
 }
 
-ChangesData GitWrapper::getChangedFiles(const std::string& newCommitShaStr, const std::string& oldCommitShaStr) {
+RevisionRange::~RevisionRange() {
+    git_diff_free(diff);
+    git_tree_free(newTree);
+    git_tree_free(oldTree);
+    git_commit_free(newCommit);
+    git_commit_free(oldCommit);
+}
+
+RevisionRange::RevisionRange(RevisionRange && other) noexcept
+    : newCommit(std::exchange(other.newCommit, nullptr))
+    , oldCommit(std::exchange(other.oldCommit, nullptr))
+    , newTree(std::exchange(other.newTree, nullptr))
+    , oldTree(std::exchange(other.oldTree, nullptr))
+    , diff(std::exchange(other.diff, nullptr))
+    , joinedCommitMsg(std::move(other.joinedCommitMsg)) {
+}
+
+RevisionRange GitWrapper::resolveRange(const std::string& newCommitShaStr, const std::string& oldCommitShaStr) {
+    RevisionRange range;
     git_object * newObj = nullptr;
     git_object * oldObj = nullptr;
     ok(git_revparse_single(&newObj, repo, newCommitShaStr.c_str()), "commit spec revparse - new");
-    const git_oid * newCommitId = git_object_id(newObj);
     ok(git_revparse_single(&oldObj, repo, oldCommitShaStr.c_str()), "commit spec revparse - old");
-    const git_oid * oldCommitId = git_object_id(oldObj);
-    git_commit * oldCommit = nullptr;
-    git_commit * newCommit = nullptr;
-    ok(git_commit_lookup(&oldCommit, repo, oldCommitId), "old commit");
-    ok(git_commit_lookup(&newCommit, repo, newCommitId), "new commit");
-    git_tree * oldTree = nullptr;
-    git_tree * newTree = nullptr;
-    ok(git_tree_lookup(&oldTree, repo, git_commit_tree_id(oldCommit)), "old tree");
-    ok(git_tree_lookup(&newTree, repo, git_commit_tree_id(newCommit)), "new tree");
-    git_commit_free(oldCommit);
-    git_commit_free(newCommit);
+    ok(git_commit_lookup(&range.newCommit, repo, git_object_id(newObj)), "new commit");
+    ok(git_commit_lookup(&range.oldCommit, repo, git_object_id(oldObj)), "old commit");
     git_object_free(newObj);
     git_object_free(oldObj);
-    ChangesData ret = getChangedFiles(oldTree, newTree);
-    git_tree_free(oldTree);
-    git_tree_free(newTree);
-    return ret;
+    ok(git_commit_tree(&range.newTree, range.newCommit), "new tree");
+    ok(git_commit_tree(&range.oldTree, range.oldCommit), "old tree");
+    return range;
 }
 
-HeadData GitWrapper::getHeadSha(){
-    git_reference *refefence = nullptr;
-    ok(git_repository_head(&refefence, repo), "repository head");
-    std::string refName = git_reference_name(refefence);
-    git_annotated_commit *annotatedCommit = nullptr;
-    ok(git_annotated_commit_from_ref(&annotatedCommit, repo, refefence), "head commit");
-    const git_oid * oid = git_annotated_commit_id(annotatedCommit);
-    char sha[128];
-    git_oid_tostr(sha, 128, oid);
-    return HeadData{
-        .sha = sha,
-        .refName = refName,
-    };
+git_diff * GitWrapper::treeDiff(RevisionRange & range) {
+    if (!range.diff) {
+        git_diff_options diffopts = getDiffOptsIgnoreWhiteSpace();
+        ok(git_diff_tree_to_tree(&range.diff, repo, range.oldTree, range.newTree, &diffopts), "tree diff");
+    }
+    return range.diff;
 }
 
-bool GitWrapper::canCheckout(const std::string & targetRevSpec) {
-    git_annotated_commit * target = nullptr;
-    git_checkout_options checkout_opts = GIT_CHECKOUT_OPTIONS_INIT;
-    checkout_opts.checkout_strategy = GIT_CHECKOUT_NONE;
-    bool success = true;
-    try {
-        ok(git_annotated_commit_from_revspec(&target, repo, targetRevSpec.c_str()), "test checkout - target commit");
-        git_commit * commit;
-        ok(git_commit_lookup(&commit, repo, git_annotated_commit_id(target)), "test checkout - commit lookup");
-        ok(git_checkout_tree(repo, (const git_object *)commit, &checkout_opts), "test checkout - checkout tree");
-    } catch (std::runtime_error & e) {
-        LogErr(e.what());
-        success = false;
-    }
-    git_annotated_commit_free(target);
-    LogDev("OK - checkout test");
-    return success;
+std::string GitWrapper::getGitDir() {
+    return git_repository_path(repo);
+}
+
+std::string GitWrapper::getWorkDir() {
+    const char * workDir = git_repository_workdir(repo);
+    return workDir ? workDir : "";
 }
 
-void GitWrapper::doCheckout(const std::string & targetRevSpec) {
-    git_annotated_commit * target = nullptr;
+void GitWrapper::checkoutTo(const std::string & targetRevSpec, const std::string & directory) {
+    git_object * target = nullptr;
+    ok(git_revparse_single(&target, repo, targetRevSpec.c_str()), "checkout - target commit");
+    // directory is empty: baseline is an empty index, not the index of the repository
+    git_index * emptyIndex = nullptr;
+    int status = git_index_new(&emptyIndex);
+    if (status) {
+        git_object_free(target);
+        ok(status, "checkout - empty index");
+    }
     git_checkout_options checkout_opts = GIT_CHECKOUT_OPTIONS_INIT;
-    checkout_opts.checkout_strategy = GIT_CHECKOUT_SAFE;
-    
-    ok(git_annotated_commit_from_revspec(&target, repo, targetRevSpec.c_str()), "checkout - target commit");
-    git_commit * commit;
-    ok(git_commit_lookup(&commit, repo, git_annotated_commit_id(target)), "checkout - commit lookup");
-    ok(git_checkout_tree(repo, (const git_object *)commit, &checkout_opts), "checkout - checkout tree");
-    ok(git_repository_set_head_detached(repo, git_annotated_commit_id(target)), "checkout - detach dead");
-    git_annotated_commit_free(target);
+    // every file of target is written
+    checkout_opts.checkout_strategy = GIT_CHECKOUT_FORCE | GIT_CHECKOUT_RECREATE_MISSING | GIT_CHECKOUT_DONT_UPDATE_INDEX;
+    checkout_opts.target_directory = directory.c_str();
+    checkout_opts.baseline_index = emptyIndex;
+    status = git_checkout_tree(repo, target, &checkout_opts);
+    git_index_free(emptyIndex);
+    git_object_free(target);
+    ok(status, "checkout - checkout tree");
     LogDev("OK - checkout");
 }
 
-void GitWrapper::doCheckoutHead(const HeadData & headData) {
-    doCheckout(headData.sha);
-    ok(git_repository_set_head(repo, headData.refName.c_str()), "set head");
+std::string GitWrapper::getTreeId(const std::string & revSpec) {
+    git_object * target = nullptr;
+    ok(git_revparse_single(&target, repo, revSpec.c_str()), "tree id - revparse");
+    git_object * tree = nullptr;
+    int status = git_object_peel(&tree, target, GIT_OBJECT_TREE);
+    git_object_free(target);
+    ok(status, "tree id - peel");
+    std::string id = hexId(*git_object_id(tree));
+    git_object_free(tree);
+    return id;
+}
+
+std::vector<ChangedFile> GitWrapper::getTreeChanges(const std::string & oldTreeId, const std::string & newTreeId) {
+    git_oid oldOid, newOid;
+    ok(git_oid_fromstr(&oldOid, oldTreeId.c_str()), "tree changes - old id");
+    ok(git_oid_fromstr(&newOid, newTreeId.c_str()), "tree changes - new id");
+    git_tree * oldTree = nullptr;
+    git_tree * newTree = nullptr;
+    git_diff * diff = nullptr;
+    int status = git_tree_lookup(&oldTree, repo, &oldOid);
+    if (!status) {
+        status = git_tree_lookup(&newTree, repo, &newOid);
+    }
+    if (!status) {
+        // type changes are delete and add, deleted path comes first
+        git_diff_options diffopts = GIT_DIFF_OPTIONS_INIT;
+        status = git_diff_tree_to_tree(&diff, repo, oldTree, newTree, &diffopts);
+    }
+    std::vector<ChangedFile> result;
+    if (!status) {
+        size_t count = git_diff_num_deltas(diff);
+        result.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            const git_diff_delta * delta = git_diff_get_delta(diff, i);
+            ChangedFile file;
+            file.name = delta->new_file.path;
+            file.newId = hexId(delta->new_file.id);
+            file.oldId = hexId(delta->old_file.id);
+            file.newMode = delta->new_file.mode;
+            result.push_back(std::move(file));
+        }
+    }
+    git_diff_free(diff);
+    git_tree_free(newTree);
+    git_tree_free(oldTree);
+    ok(status, "tree changes");
+    return result;
 }
 
 std::vector<int> GitWrapper::compareLogs(std::string oldLog, std::string newLog) {
@@ -179,99 +244,96 @@ std::vector<int> GitWrapper::compareLogs(std::string oldLog, std::string newLog)
     return addedLines;
 }
 
-ChangesData GitWrapper::getChangedFiles(git_tree * oldTree, git_tree * newTree) {
-    git_diff * diff = nullptr;
-    git_diff_options diffopts = getDiffOptsIgnoreWhiteSpace();
-    ok(git_diff_tree_to_tree(&diff, repo, oldTree, newTree, &diffopts), "tree diff");
-    ChangesData result;
-    Messages msgs;
-    FileCbPayload payload = {.msgs = msgs, .newFiles = result.newFiles};
-    ok(git_diff_foreach(diff, file_cb, nullptr, nullptr, nullptr, &payload), "diff foreach");
-    for (auto && file : payload.newFiles) {
-        struct LoopItem {
-            git_tree * tree;
-            decltype(result.newFileContent) & contentDst;
-        };
-        for ( auto && loopItem : ( LoopItem[] ) {{.tree = newTree, .contentDst = result.newFileContent }, {.tree = oldTree, .contentDst = result.oldFileContent}} ) {
-            git_tree_entry * entry = nullptr;
-            auto entry_status = git_tree_entry_bypath(&entry, loopItem.tree, file.c_str());
-            bool fileExist = false;
-            if (entry && entry_status == 0) {
-                git_object * object = nullptr;
-                ok(git_tree_entry_to_object(&object, repo, entry), "git tree entry to object");
-                git_otype objectType = git_object_type(object);
-                if (objectType == GIT_OBJ_BLOB) {
-                    const git_oid * blobId = git_object_id(object);
-                    git_blob * blob = nullptr;
-                    git_blob_lookup(&blob, repo, blobId);
-                    size_t size = git_blob_rawsize(blob);
-                    std::string data((const char*)git_blob_rawcontent(blob), size);
-                    git_blob_free(blob);
-                    fileExist = true;
-                    loopItem.contentDst.push_back(data);
-                }
-                git_object_free(object);
-                git_tree_entry_free(entry);
-            }
-            if (!fileExist ) {
-                loopItem.contentDst.push_back(std::string());
-            }
+void GitWrapper::forEachChangedFile(RevisionRange & range, const std::function<void(ChangedFile &&)> & callback) {
+    git_diff * diff = treeDiff(range);
+    FileCbPayload payload;
+    payload.onDelta = [this, &callback](const git_diff_delta & delta) {
+        ChangedFile file;
+        file.name = delta.new_file.path;
+        file.newId = hexId(delta.new_file.id);
+        file.newMode = delta.new_file.mode;
+        file.newSize = blobSize(delta.new_file.id);
+        if (delta.old_file.mode != GIT_FILEMODE_COMMIT) {
+            file.oldId = hexId(delta.old_file.id);
+            file.oldSize = blobSize(delta.old_file.id);
         }
+        callback(std::move(file));
+    };
+    int status = git_diff_foreach(diff, file_cb, nullptr, nullptr, nullptr, &payload);
+    if (payload.error) {
+        std::rethrow_exception(payload.error);
     }
-    git_diff_free(diff);
-    return result;
+    ok(status, "diff foreach");
 }
 
-std::string GitWrapper::getAddedLines(const std::string& newCommitShaStr, const std::string& oldCommitShaStr, const std::string& fileName) {
-    git_object * newObj = nullptr;
-    git_object * oldObj = nullptr;
-    ok(git_revparse_single(&newObj, repo, newCommitShaStr.c_str()), "commit spec revparse - new");
-    ok(git_revparse_single(&oldObj, repo, oldCommitShaStr.c_str()), "commit spec revparse - old");
+size_t GitWrapper::blobSize(const git_oid & id) {
+    if (git_oid_iszero(&id)) {
+        return 0;
+    }
+    git_odb * odb = nullptr;
+    ok(git_repository_odb(&odb, repo), "object database");
+    size_t size = 0;
+    git_otype type;
+    int status = git_odb_read_header(&size, &type, odb, &id);
+    git_odb_free(odb);
+    ok(status, "blob header");
+    return size;
+}
 
-    const git_oid * newCommitId = git_object_id(newObj);
-    const git_oid * oldCommitId = git_object_id(oldObj);
-    
-    git_commit * newCommit = nullptr;
-    git_commit * oldCommit = nullptr;
-    ok(git_commit_lookup(&newCommit, repo, newCommitId), "new commit lookup");
-    ok(git_commit_lookup(&oldCommit, repo, oldCommitId), "old commit lookup");
+std::string GitWrapper::readBlob(const std::string & id) {
+    if (id.empty()) {
+        return std::string();
+    }
+    git_oid oid;
+    ok(git_oid_fromstr(&oid, id.c_str()), "blob id");
+    git_blob * blob = nullptr;
+    ok(git_blob_lookup(&blob, repo, &oid), "blob lookup");
+    std::string data(static_cast<const char*>(git_blob_rawcontent(blob)), git_blob_rawsize(blob));
+    git_blob_free(blob);
+    return data;
+}
 
-    git_tree * newTree = nullptr;
-    git_tree * oldTree = nullptr;
-    ok(git_commit_tree(&newTree, newCommit), "new commit tree");
-    ok(git_commit_tree(&oldTree, oldCommit), "old commit tree");
+std::string GitWrapper::readBlobFiltered(const std::string & id, const std::string & path) {
+    git_oid oid;
+    ok(git_oid_fromstr(&oid, id.c_str()), "blob id");
+    git_blob * blob = nullptr;
+    ok(git_blob_lookup(&blob, repo, &oid), "blob lookup");
+    // no GIT_BLOB_FILTER_CHECK_FOR_BINARY, as checkout binary files are left to filters
+    git_blob_filter_options options = {};
+    options.version = GIT_BLOB_FILTER_OPTIONS_VERSION;
+    git_buf buffer = {};
+    int error = git_blob_filter(&buffer, blob, path.c_str(), &options);
+    git_blob_free(blob);
+    std::string data;
+    if (!error && buffer.ptr) {
+        data.assign(buffer.ptr, buffer.size);
+    }
+    git_buf_dispose(&buffer);
+    ok(error, "blob filter");
+    return data;
+}
 
-    git_diff_options diffopts = getDiffOptsIgnoreWhiteSpace();
-    
-    git_diff * diff = nullptr;
-    git_diff_tree_to_tree(&diff, repo, oldTree, newTree, &diffopts);
-    
-    std::string result;
+std::map<std::string, AddedLines> GitWrapper::getAddedLines(RevisionRange & range) {
+    std::map<std::string, AddedLines> result;
     getAddedLines_payload payload = {
-        .fileName = fileName,
         .result = result,
     };
     
-    git_diff_foreach(diff, nullptr, nullptr, nullptr, getAddedLines_line_cb, (void*)(&payload));
-
-    git_diff_free(diff);
-    git_tree_free(newTree);
-    git_commit_free(newCommit);
-    git_commit_free(oldCommit);
-    git_object_free(newObj);
-    git_object_free(oldObj);
+    ok(git_diff_foreach(treeDiff(range), nullptr, nullptr, nullptr, getAddedLines_line_cb, (void*)(&payload)), "diff foreach");
     
     return result;
 }
 
-std::string GitWrapper::getJoinedCommitMsg(const std::string& newCommitShaStr, const std::string& oldCommitShaStr){
-    
-    auto range = oldCommitShaStr + ".." + newCommitShaStr;
-    
+const std::string & GitWrapper::getJoinedCommitMsg(RevisionRange & range) {
+    if (range.joinedCommitMsg) {
+        return *range.joinedCommitMsg;
+    }
     git_revwalk *walk = nullptr;
     ok(git_revwalk_new(&walk, repo), "revwalk");
     git_revwalk_sorting(walk, GIT_SORT_REVERSE);
-    ok(git_revwalk_push_range(walk, range.c_str()), "revwalk push range");
+    // as range old..new
+    ok(git_revwalk_push(walk, git_commit_id(range.newCommit)), "revwalk push");
+    ok(git_revwalk_hide(walk, git_commit_id(range.oldCommit)), "revwalk hide");
     std::string result;
     git_oid oid;
     while ((git_revwalk_next(&oid, walk)) == 0) {
@@ -280,5 +342,6 @@ std::string GitWrapper::getJoinedCommitMsg(const std::string& newCommitShaStr, c
         result += git_commit_message(commit);
         git_commit_free(commit);
     }
-    return result;
+    git_revwalk_free(walk);
+    return range.joinedCommitMsg.emplace(std::move(result));
 }
@@ -18,22 +18,61 @@
 
 #pragma once
 
+#include <functional>
+#include <map>
+#include <optional>
 #include <vector>
 #include <string>
 
 struct git_repository;
+struct git_commit;
 struct git_tree;
+struct git_diff;
+struct git_oid;
 
-/// structure of arrays
+/// structure of arrays, content is read with GitWrapper::readBlob() when a task needs it
 struct ChangesData {
     std::vector<std::string> newFiles;
-    std::vector<std::string> newFileContent;
-    std::vector<std::string> oldFileContent;
+    std::vector<std::string> newIds;
+    std::vector<std::string> oldIds;
+    std::vector<unsigned> newModes;
+    std::vector<size_t> newSizes;
+    std::vector<size_t> oldSizes;
 };
 
-struct HeadData {
-    std::string sha;
-    std::string refName;
+struct ChangedFile {
+    std::string name;
+    std::string newId;      ///< hex id of blob, empty if deleted
+    std::string oldId;      ///< empty if added
+    unsigned newMode = 0;   ///< git filemode
+    size_t newSize = 0;
+    size_t oldSize = 0;
+};
+
+struct AddedLines {
+    std::string text;               ///< added lines, joined
+    std::vector<int> lineNumbers;   ///< in new file
+};
+
+/**
+ * Revisions of a run, resolved once by GitWrapper::resolveRange().
+ * Commits and trees are kept, tree diff and commit messages are kept after first use,
+ * so calls with the same range do not parse the same objects again.
+ */
+class RevisionRange {
+    friend class GitWrapper;
+    git_commit * newCommit = nullptr;
+    git_commit * oldCommit = nullptr;
+    git_tree * newTree = nullptr;
+    git_tree * oldTree = nullptr;
+    git_diff * diff = nullptr;
+    std::optional<std::string> joinedCommitMsg;
+    RevisionRange() = default;
+public:
+    ~RevisionRange();
+    RevisionRange(RevisionRange && other) noexcept;
+    RevisionRange(const RevisionRange &) = delete;
+    RevisionRange & operator=(const RevisionRange &) = delete;
 };
 
 class GitWrapper {
@@ -41,14 +80,31 @@ class GitWrapper {
 public:
     explicit GitWrapper(const std::string & repoPath);
     ~GitWrapper();
-    ChangesData getChangedFiles(const std::string & newCommitShaStr, const std::string & oldCommitShaStr);
-    std::string getJoinedCommitMsg(const std::string & newCommitShaStr, const std::string & oldCommitShaStr);
-    std::string getAddedLines(const std::string & newCommitShaStr, const std::string & oldCommitShaStr, const std::string & fileName);
-    bool canCheckout(const std::string & targetRevSpec);
-    void doCheckout(const std::string & targetRevSpec);
-    void doCheckoutHead(const HeadData & headData);
-    HeadData getHeadSha();
+    RevisionRange resolveRange(const std::string & newCommitShaStr, const std::string & oldCommitShaStr);
+    /// files in order of tree diff, every file is passed as soon as its delta is found, blobs are not read
+    void forEachChangedFile(RevisionRange & range, const std::function<void(ChangedFile &&)> & callback);
+    /// messages of commits in range, oldest first
+    const std::string & getJoinedCommitMsg(RevisionRange & range);
+    /// added lines of all changed files by new path, from one diff
+    std::map<std::string, AddedLines> getAddedLines(RevisionRange & range);
+    /// files of revision written to empty directory, worktree, index and HEAD of repository are not changed
+    void checkoutTo(const std::string & targetRevSpec, const std::string & directory);
+    /// hex id of tree of revision
+    std::string getTreeId(const std::string & revSpec);
+    /// entries differing between trees by id or mode, in path order, white spaces are not ignored, sizes are not read
+    std::vector<ChangedFile> getTreeChanges(const std::string & oldTreeId, const std::string & newTreeId);
+    /// path of .git directory, with trailing slash
+    std::string getGitDir();
+    /// path of worktree, with trailing slash, empty for bare repository
+    std::string getWorkDir();
     static std::vector<int> compareLogs(std::string oldLog, std::string newLog);
+    /// content of blob with hex id, empty for empty id
+    std::string readBlob(const std::string & id);
+    /// content of blob as checkout writes it to path, with filters of attributes and config (eol, ident)
+    std::string readBlobFiltered(const std::string & id, const std::string & path);
 private:
-    ChangesData getChangedFiles(git_tree * oldTree, git_tree * newTree);
+    /// diff of trees of range, ignoring white spaces, created on first use
+    git_diff * treeDiff(RevisionRange & range);
+    /// size from object header, content is not inflated, 0 for zero id
+    size_t blobSize(const git_oid & id);
 };
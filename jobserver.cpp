@@ -0,0 +1,265 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jobserver.h"
+#include "process.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+
+namespace {
+    bool active = false;
+    /// tokens of jobserver, own file description, so non-blocking mode is not shared with make
+    int tokenFd = -1;
+    /// semaphore with the implicit slot of this process
+    int implicitFd = -1;
+    /// of created FIFO
+    std::string fifoDir;
+    /// of created pipe, inherited by children
+    int pipeFds[2] = {-1, -1};
+    /// task holding part of its slots blocks others, so two tasks cannot wait for each other
+    std::mutex acquireMutex;
+    /// without jobserver
+    std::mutex localMutex;
+    std::condition_variable localReleased;
+    unsigned localFree = 1;
+    /// all slots of jobserver, more cannot be collected
+    unsigned poolSlots = 1;
+
+    /// @return value of last jobserver option in MAKEFLAGS, "fifo:PATH" or "R,W", empty if none
+    /// @param jobs set to N of -jN when present
+    std::string makeflagsAuth(unsigned & jobs) {
+        const char * makeflags = std::getenv("MAKEFLAGS");
+        if (!makeflags) {
+            return std::string();
+        }
+        std::istringstream words(makeflags);
+        std::string word;
+        std::string auth;
+        while (words >> word) {
+            if (word == "--") {
+                // variable definitions follow
+                break;
+            }
+            for (const char * prefix : {"--jobserver-auth=", "--jobserver-fds="}) {
+                if (word.rfind(prefix, 0) == 0) {
+                    auth = word.substr(std::strlen(prefix));
+                }
+            }
+            if (word.rfind("-j", 0) == 0 && word.size() > 2) {
+                jobs = std::max(1ul, std::strtoul(word.c_str() + 2, nullptr, 10));
+            }
+        }
+        return auth;
+    }
+
+    /// pipe descriptors stay open and blocking for make started by tasks
+    int reopenPipe(int readFd) {
+        return ::open(("/proc/self/fd/" + std::to_string(readFd)).c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    }
+
+    bool joinMake(const std::string & auth) {
+        if (auth.rfind("fifo:", 0) == 0) {
+            tokenFd = ::open(auth.c_str() + 5, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        } else {
+            int readFd = -1;
+            int writeFd = -1;
+            char comma = 0;
+            std::istringstream(auth) >> readFd >> comma >> writeFd;
+            if (comma != ',' || readFd < 0 || writeFd < 0 || ::fcntl(readFd, F_GETFD) == -1 || ::fcntl(writeFd, F_GETFD) == -1) {
+                LogErr("jobserver of make is not passed to git-verify (mark the recipe with '+'), tasks do not share slots with make");
+                return false;
+            }
+            tokenFd = reopenPipe(readFd);
+        }
+        if (tokenFd == -1) {
+            LogErr("cannot open jobserver ", auth, ": ", std::strerror(errno), ", tasks do not share slots with make");
+            return false;
+        }
+        return true;
+    }
+
+    /// @return jobserver value of MAKEFLAGS
+    std::string createFifo() {
+        const char * tmpDir = std::getenv("TMPDIR");
+        std::string dir = std::string(tmpDir && *tmpDir ? tmpDir : "/tmp") + "/git-verify-jobserver-XXXXXX";
+        if (!::mkdtemp(dir.data())) {
+            LogErr("cannot create jobserver directory ", dir, ": ", std::strerror(errno));
+            return std::string();
+        }
+        fifoDir = dir;
+        std::string path = dir + "/fifo";
+        if (::mkfifo(path.c_str(), 0600) == -1 || (tokenFd = ::open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC)) == -1) {
+            LogErr("cannot create jobserver ", path, ": ", std::strerror(errno));
+            return std::string();
+        }
+        return "fifo:" + path;
+    }
+
+    /// @return jobserver value of MAKEFLAGS
+    std::string createPipe() {
+        if (::pipe(pipeFds) == -1 || (tokenFd = reopenPipe(pipeFds[0])) == -1) {
+            LogErr("cannot create jobserver pipe: ", std::strerror(errno));
+            return std::string();
+        }
+        return std::to_string(pipeFds[0]) + "," + std::to_string(pipeFds[1]);
+    }
+
+    bool createJobserver(unsigned slots, JobserverStyle style) {
+        auto auth = style == JobserverStyle::FIFO ? createFifo() : createPipe();
+        std::string tokens(slots - 1, '+');
+        if (auth.empty() || (tokens.size() && ::write(tokenFd, tokens.data(), tokens.size()) != static_cast<ssize_t>(tokens.size()))) {
+            if (auth.size()) {
+                LogErr("cannot write jobserver tokens: ", std::strerror(errno));
+            }
+            finishJobserver();
+            return false;
+        }
+        // removed also on exit after error
+        std::atexit(finishJobserver);
+        std::string makeflags = "-j" + std::to_string(slots) + " --jobserver-auth=" + auth;
+        if (const char * oldFlags = std::getenv("MAKEFLAGS"); oldFlags && *oldFlags) {
+            // single letter flags without dash are allowed only as first word
+            makeflags += std::string(oldFlags[0] == '-' ? " " : " -") + oldFlags;
+        }
+        ::setenv("MAKEFLAGS", makeflags.c_str(), 1);
+        return true;
+    }
+}
+
+void initJobserver(unsigned slots, JobserverStyle style) {
+    localFree = std::max(slots, 1u);
+    poolSlots = localFree;
+    if (style == JobserverStyle::OFF) {
+        return;
+    }
+    implicitFd = ::eventfd(1, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+    if (implicitFd == -1) {
+        LogErr("cannot create jobserver slot: ", std::strerror(errno));
+        return;
+    }
+    // without -jN make does not tell its slots, one is surely there
+    unsigned makeJobs = 1;
+    auto auth = makeflagsAuth(makeJobs);
+    active = auth.empty() ? createJobserver(std::max(slots, 1u), style) : joinMake(auth);
+    if (active && auth.size()) {
+        poolSlots = makeJobs;
+    }
+}
+
+void finishJobserver() {
+    active = false;
+    if (tokenFd >= 0) {
+        ::close(tokenFd);
+        tokenFd = -1;
+    }
+    if (fifoDir.size()) {
+        ::unlink((fifoDir + "/fifo").c_str());
+        ::rmdir(fifoDir.c_str());
+        fifoDir.clear();
+    }
+    for (auto & fd : pipeFds) {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+}
+
+JobSlot::JobSlot(unsigned count) : count(std::clamp(count, 1u, poolSlots)) {
+    std::lock_guard<std::mutex> acquireLock(acquireMutex);
+    if (!active) {
+        std::unique_lock<std::mutex> lock(localMutex);
+        while (localFree < this->count) {
+            if (processesCancelled()) {
+                return;
+            }
+            localReleased.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        localFree -= this->count;
+        held = true;
+        return;
+    }
+    while (!processesCancelled()) {
+        uint64_t value = 0;
+        char token = 0;
+        if (!implicit && ::read(implicitFd, &value, sizeof(value)) == sizeof(value)) {
+            implicit = true;
+        } else if (::read(tokenFd, &token, 1) == 1) {
+            tokens.push_back(token);
+        } else {
+            // token may be taken by make or other thread before read, then wait again
+            struct pollfd fds[] = {{implicitFd, POLLIN, 0}, {tokenFd, POLLIN, 0}, {cancelEventFd(), POLLIN, 0}};
+            ::poll(fds, 3, -1);
+            continue;
+        }
+        if (tokens.size() + (implicit ? 1 : 0) == this->count) {
+            held = true;
+            return;
+        }
+    }
+    returnSlots();
+}
+
+JobSlot::~JobSlot() {
+    release();
+}
+
+void JobSlot::release() {
+    if (held) {
+        returnSlots();
+        held = false;
+    }
+}
+
+void JobSlot::returnSlots() {
+    if (!active) {
+        {
+            std::lock_guard<std::mutex> lock(localMutex);
+            localFree += count;
+        }
+        localReleased.notify_all();
+        return;
+    }
+    if (implicit) {
+        uint64_t value = 1;
+        while (::write(implicitFd, &value, sizeof(value)) == -1 && errno == EINTR) {
+        }
+    }
+    // the same tokens are returned, make may use different characters
+    size_t written = 0;
+    while (written < tokens.size()) {
+        ssize_t n = ::write(tokenFd, tokens.data() + written, tokens.size() - written);
+        if (n == -1 && errno != EINTR) {
+            break;
+        }
+        written += std::max<ssize_t>(n, 0);
+    }
+}
@@ -0,0 +1,62 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <string>
+
+enum class JobserverStyle {
+    FIFO,   ///< named pipe, make >= 4.4 and ninja >= 1.13
+    PIPE,   ///< inherited pipe descriptors, all GNU make versions
+    OFF,
+};
+
+/**
+ * GNU make jobserver, every running task holds one slot.
+ * Started by make (jobserver in MAKEFLAGS) git-verify takes slots from make,
+ * otherwise it creates a jobserver and exports it in MAKEFLAGS, so make and ninja started by tasks share its slots.
+ * Without jobserver slots are only counted in this process.
+ * Must be called before any thread is started, environment is changed.
+ * @param slots slots of created jobserver, including the implicit one
+ */
+void initJobserver(unsigned slots, JobserverStyle style);
+/// remove created FIFO
+void finishJobserver();
+
+/// jobserver slots of running task, released on destruction
+class JobSlot {
+    unsigned count;
+    std::string tokens;     ///< read from jobserver, returned as they were
+    bool implicit = false;
+    bool held = false;
+
+    void returnSlots();
+public:
+    /// block until slots are free or processes are cancelled, slots are collected by one task at a time
+    /// @param count at most slots of jobserver
+    explicit JobSlot(unsigned count = 1);
+    ~JobSlot();
+    JobSlot(const JobSlot &) = delete;
+    JobSlot & operator=(const JobSlot &) = delete;
+    /// false when cancelled while waiting
+    bool acquired() const {
+        return held;
+    }
+    /// before destruction, when task outlives its process
+    void release();
+};
@@ -22,34 +22,231 @@
 #include "taskBase.h"
 #include "gitWrapper.h"
 #include "common.h"
+#include "process.h"
+#include "usageReport.h"
+#include "executor.h"
+#include "processLoop.h"
+#include "durationHistory.h"
+#include "treeCache.h"
+#include "jobserver.h"
+#include "concurrency.h"
 
 #include <vector>
+#include <algorithm>
+#include <functional>
 #include <string>
 #include <map>
 #include <memory>
 #include <iostream>
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <thread>
-
-std::atomic<unsigned> taskID;
+#include <sstream>
+#include <filesystem>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 
 using Tasks = std::vector<TaskPtr>;
 
 namespace {
+    using Processings = std::vector<std::unique_ptr<Processing>>;
+
     struct TaskResult {
-        Messages msgs;
+        Messages msgs;      ///< processed output
         TaskRunDescription descr;
-        int status = -1;
+        int status = -1;    ///< processed status, -1 until done
+        RunStatus runStatus = RunStatus::EXITED;
+        ResourceUsage usage;
+        bool reported = false;  ///< output already printed by fail-fast, or with result of other task
+    };
+
+    bool failFast = false;
+    /// with --load-aware
+    LoadThrottle * loadThrottle = nullptr;
+    /// with --executor=loop
+    ProcessLoop * processLoop = nullptr;
+    /// progress and output printed while tasks run
+    std::mutex outputMutex;
+
+    /// first failure is printed at once, other tasks are cancelled
+    void failFastWith(TaskResult & result) {
+        if (processesCancelled()) {
+            return;
+        }
+        cancelAllProcesses();
+        std::lock_guard<std::mutex> lock(outputMutex);
+        LogErr("fail-fast, failed ", result.descr.taskTypeName, ": \"", result.descr.fileName, "\"");
+        for (auto && msg : result.msgs) {
+            print_msg(msg);
+        }
+        result.reported = true;
+    }
+
+    /**
+     * Task runs in calling thread, or with processLoop its process is started and the thread is free at once.
+     * @param then called after task finished, in calling thread or in thread of processLoop, must not block
+     */
+    void runTask(Task & task, TaskResult & taskResult, std::function<void()> then) {
+        taskResult.descr = task.getDescr();
+        taskResult.runStatus = RunStatus::CANCELLED;
+        unsigned slots = std::clamp(task.getSlots(), 1u, concurrency());
+        if (loadThrottle && !loadThrottle->acquire(slots)) {
+            then();
+            return;
+        }
+        // slots are shared with make and ninja started by tasks
+        auto slot = std::make_shared<JobSlot>(slots);
+        auto release = [slot, slots]() {
+            slot->release();
+            if (loadThrottle) {
+                loadThrottle->release(slots);
+            }
+        };
+        if (!slot->acquired() || processesCancelled()) {
+            release();
+            then();
+            return;
+        }
+        auto finish = [&task, &taskResult, release, then](Messages msgs) {
+            taskResult.msgs = std::move(msgs);
+            taskResult.runStatus = task.getRunStatus();
+            taskResult.usage = task.getUsage();
+            release();
+            then();
+        };
+        if (processLoop && task.start(*processLoop, finish)) {
+            return;
+        }
+        finish(task.run());
+    }
+
+    /// processed as soon as task is done, failure is known before other tasks finish
+    void processTask(Task & task, Processing & processing, TaskResult & taskResult) {
+        task.cleanup();
+        int status = 0;
+        if (taskResult.runStatus == RunStatus::EXITED) {
+            taskResult.msgs = processing.process(std::move(taskResult.msgs), task.getStatus());
+            status = processing.getStatus();
+        } else if (taskResult.runStatus != RunStatus::CANCELLED) {
+            status = 1;
+        }
+        if (failFast && status) {
+            failFastWith(taskResult);
+        }
+        taskResult.reported |= processing.reportedByOther();
+        taskResult.status = status;
+    }
+
+    struct Options {
+        Launcher launcher = Launcher::SPAWN;
+        double deadline = 0;    ///< seconds for whole run, 0 - no limit
+        size_t taskOutputMemory = 16;   ///< MiB of one output kept in memory
+        size_t outputMemory = 256;      ///< MiB of all outputs kept in memory
+        std::string usageReport;        ///< file for per task resource usage
+        bool cgroups = false;
+        bool failFast = false;
+        bool history = true;            ///< keep task durations for scheduling
+        bool treeCache = true;          ///< old revision copied from trees of earlier runs
+        JobserverStyle jobserver = JobserverStyle::PIPE;
+        unsigned jobs = 0;              ///< tasks in parallel, 0 - from CPU affinity and quota
+        bool loadAware = false;
+        size_t memory = 0;              ///< MiB for tasks, 0 - available at start
+        bool processLoop = false;       ///< processes watched by one thread instead of thread per task
     };
 
-    void runTask(const Tasks & tasks, std::vector<TaskResult> & result, unsigned id) {
-        auto maxId = tasks.size();
-        while (id < maxId) {
-            result[id].msgs = tasks[id]->run();
-            result[id].status = tasks[id]->getStatus();
-            result[id].descr = tasks[id]->getDescr();
-            id = taskID.fetch_add(1, std::memory_order_relaxed);
+    size_t parseNumber(const std::string & name, const std::string & value) {
+        char * end = nullptr;
+        auto result = std::strtoull(value.c_str(), &end, 10);
+        if (value.empty() || *end) {
+            LogErr("invalid ", name, ": ", value);
+            std::exit(1);
         }
+        return result;
+    }
+
+    /// @return false if arg is not an option
+    bool parseOption(const std::string & arg, Options & options) {
+        if (arg.rfind("-j", 0) == 0) {
+            return parseOption("--jobs=" + arg.substr(2), options);
+        }
+        if (arg.rfind("--", 0) != 0 || arg == "--help") {
+            return false;
+        }
+        auto eqPos = arg.find('=');
+        auto name = arg.substr(0, eqPos);
+        auto value = eqPos == std::string::npos ? std::string() : arg.substr(eqPos + 1);
+        if (name == "--launcher") {
+            if (value == "spawn") {
+                options.launcher = Launcher::SPAWN;
+            } else if (value == "pstreams") {
+                options.launcher = Launcher::PSTREAMS;
+            } else {
+                LogErr("unknown launcher: ", value);
+                std::exit(1);
+            }
+        } else if (name == "--task-output-memory") {
+            options.taskOutputMemory = parseNumber(name, value);
+        } else if (name == "--output-memory") {
+            options.outputMemory = parseNumber(name, value);
+        } else if (name == "--fail-fast") {
+            options.failFast = true;
+        } else if (name == "--jobserver") {
+            if (value == "fifo") {
+                options.jobserver = JobserverStyle::FIFO;
+            } else if (value == "pipe") {
+                options.jobserver = JobserverStyle::PIPE;
+            } else if (value == "off") {
+                options.jobserver = JobserverStyle::OFF;
+            } else {
+                LogErr("unknown jobserver: ", value);
+                std::exit(1);
+            }
+        } else if (name == "--jobs") {
+            options.jobs = parseNumber(name, value);
+            if (options.jobs == 0) {
+                LogErr("invalid ", name, ": ", value);
+                std::exit(1);
+            }
+        } else if (name == "--executor") {
+            if (value == "threads") {
+                options.processLoop = false;
+            } else if (value == "loop") {
+                options.processLoop = true;
+            } else {
+                LogErr("unknown executor: ", value);
+                std::exit(1);
+            }
+        } else if (name == "--memory") {
+            options.memory = parseNumber(name, value);
+        } else if (name == "--load-aware") {
+            options.loadAware = true;
+        } else if (name == "--no-history") {
+            options.history = false;
+        } else if (name == "--no-tree-cache") {
+            options.treeCache = false;
+        } else if (name == "--cgroups") {
+            options.cgroups = true;
+        } else if (name == "--usage-report") {
+            if (value.empty()) {
+                LogErr("--usage-report requires file name");
+                std::exit(1);
+            }
+            options.usageReport = value;
+        } else if (name == "--deadline") {
+            char * end = nullptr;
+            options.deadline = std::strtod(value.c_str(), &end);
+            if (value.empty() || *end || options.deadline <= 0) {
+                LogErr("invalid deadline: ", value);
+                std::exit(1);
+            }
+        } else {
+            LogErr("unknown option: ", arg);
+            std::exit(1);
+        }
+        return true;
     }
 }
 
@@ -62,6 +259,43 @@ int main(int argNum, char ** args) {
         TEST_2,
         HELP,
     };
+    Options options;
+    if (const char * envOptions = std::getenv("GIT_VERIFY_OPTIONS")) {
+        // options for hook modes, where command line is set by git
+        std::istringstream optionStream(envOptions);
+        std::string option;
+        while (optionStream >> option) {
+            if (option == "-j" && optionStream >> option) {
+                option = "-j" + option;
+            }
+            if (!parseOption(option, options)) {
+                LogErr("GIT_VERIFY_OPTIONS: not an option: ", option);
+                std::exit(1);
+            }
+        }
+    }
+    std::vector<char*> positional = {args[0]};
+    for (int i = 1; i < argNum; i++) {
+        // "-j N" as documented next to "-jN"
+        if (args[i] == std::string("-j") && i + 1 < argNum) {
+            parseOption(std::string("-j") + args[++i], options);
+            continue;
+        }
+        if (!parseOption(args[i], options)) {
+            positional.push_back(args[i]);
+        }
+    }
+    argNum = positional.size();
+    positional.push_back(nullptr);
+    args = positional.data();
+    setLauncher(options.launcher);
+    failFast = options.failFast;
+    if (options.deadline > 0) {
+        setGlobalDeadline(deadlineAfter(options.deadline));
+    }
+    installSignalForwarding();
+    Messages::setMemoryLimits(options.taskOutputMemory << 20, options.outputMemory << 20);
+
     auto exeFullName = std::string(args[0]);
     auto exeName = lastPart(exeFullName, '/');
 
@@ -91,11 +325,27 @@ int main(int argNum, char ** args) {
 Usage:
 1) pre-push
 2) pre-commit
-3) git-verify <rev>
-4) git-verify <rev1> <rev2>
+3) git-verify [options] <rev>
+4) git-verify [options] <rev1> <rev2>
 1 - as pre-push, see `git help hooks`
 2 - as pre-commit, see `git help hooks`
 3,4 - for testing in range <rev>..HEAD or <rev1>..<rev2>
+
+Options (also read from GIT_VERIFY_OPTIONS env variable):
+--launcher=spawn|pstreams   how processes are started, default spawn
+--deadline=SECONDS          kill tasks still running after SECONDS from start
+--task-output-memory=MiB    output of one task kept in memory, rest is spilled to $TMPDIR, default 16
+--output-memory=MiB         output of all tasks kept in memory, default 256
+--usage-report=FILE         write CPU time, max RSS and I/O of every task as tab separated values
+--cgroups                   run tasks in cgroup v2 with memoryMax and cpuMax limits of task type
+--fail-fast                 after first failure print it, kill running tasks and skip the rest
+--no-history                do not read nor update task durations in .git/git-verify-durations
+--no-tree-cache             check out whole old revision, without trees of earlier runs in .git/git-verify-trees
+-j N, --jobs=N              tasks run in parallel, default CPUs of affinity mask limited by cgroup CPU quota
+--load-aware                run fewer tasks while CPU pressure (PSI) or load average is high
+--memory=MiB                memory for tasks, task starts when its peak RSS in history fits, default MemAvailable at start
+--jobserver=pipe|fifo|off   make jobserver exported to tasks when not started by make, default pipe (fifo needs make 4.4)
+--executor=threads|loop     thread per running task, or one thread watching all processes (epoll, pidfd), default threads
 )");
         std::exit(0);
         break;
@@ -160,15 +410,21 @@ Usage:
         break;
     }
 
-    auto progressFct = [](const std::vector<TaskResult> & results){
+    auto progressFct = [](const char * phase, const auto & results){
         while(true) {
             using namespace std::chrono_literals;
             std::this_thread::sleep_for(100ms);
             bool allDone = true;
-            std::cout << "[";
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cout << phase << " [";
             for (auto && r : results) {
                 if (r.status != -1) {
-                    std::cout << (r.status == 0 ? '+' : 'F');
+                    switch (r.runStatus) {
+                        case RunStatus::TIMEOUT: std::cout << 'T'; break;
+                        case RunStatus::OOM_KILLED: std::cout << 'M'; break;
+                        case RunStatus::CANCELLED: std::cout << '-'; break;
+                        case RunStatus::EXITED: std::cout << (r.status == 0 ? '+' : 'F'); break;
+                    }
                 } else {
                     allDone = false;
                     std::cout << ".";
@@ -180,92 +436,365 @@ Usage:
             }
         }
     };
-    auto runTasks = [&progressFct](const Tasks & tasks, std::vector<TaskResult> & results, int forceThreadNum = 0){
-        std::vector<std::thread> threads;
-        int threadNum = forceThreadNum ? forceThreadNum : std::thread::hardware_concurrency();
-        threadNum = static_cast<int>(tasks.size()) > threadNum ? threadNum : tasks.size();
+    std::vector<UsageRecord> usageRecords;
+    setConcurrency(options.jobs ? options.jobs : availableCpus());
+    // before any thread is started, MAKEFLAGS may be changed
+    initJobserver(concurrency(), options.jobserver);
+    if (options.processLoop && !ProcessLoop::supported()) {
+        LogErr("--executor=loop needs pidfd_open (Linux 5.3), tasks run in threads");
+        options.processLoop = false;
+    }
+    // with process loop threads only start tasks and process output
+    Executor executor(options.processLoop ? std::min(concurrency(), availableCpus()) : concurrency());
+    std::unique_ptr<ProcessLoop> loop;
+    if (options.processLoop) {
+        loop = std::make_unique<ProcessLoop>(concurrency());
+        processLoop = loop.get();
+    }
+    std::unique_ptr<LoadThrottle> throttle;
+    if (options.loadAware) {
+        throttle = std::make_unique<LoadThrottle>(concurrency());
+        loadThrottle = throttle.get();
+    }
+    DurationHistory history;
+    /// usage records and history are shared by runs running at once
+    std::mutex recordsMutex;
+    MemoryBudget memoryBudget(options.memory ? static_cast<long>(options.memory << 10) : availableMemoryKiB());
+    /// @param buildCount first results are of build tasks
+    auto recordResults = [&usageRecords, &history, &recordsMutex](const char * phase, size_t buildCount, const auto & results) {
+        std::lock_guard<std::mutex> lock(recordsMutex);
+        for (size_t i = 0; i < results.size(); i++) {
+            auto & result = results[i];
+            usageRecords.push_back({i < buildCount ? "build" : phase, result.descr, result.usage, result.status, result.runStatus});
+            if (result.runStatus == RunStatus::EXITED && result.usage.wallSeconds > 0) {
+                history.record(result.descr, result.usage.wallSeconds, result.usage.maxRssKiB);
+            }
+        }
+    };
+    /**
+     * Build tasks and tasks of phase in one run, a task starts as soon as tasks it depends on are finished.
+     * Ready tasks start from the longest expected chain of dependent tasks, when their expected memory fits.
+     * Runs may run at once, they share the executor and the memory budget.
+     * @param results build tasks first, then tasks of phase
+     */
+    auto runTasks = [&progressFct, &recordResults, &executor, &history, &recordsMutex, &memoryBudget](const char * phase,
+            const Tasks & builds, const Processings & buildProcessings,
+            const Tasks & phaseTasks, const Processings & phaseProcessings,
+            const Dependencies & dependsOn, std::vector<TaskResult> & results) {
+        std::vector<Task *> tasks;
+        std::vector<Processing *> processings;
+        for (size_t i = 0; i < builds.size(); i++) {
+            tasks.push_back(builds[i].get());
+            processings.push_back(buildProcessings[i].get());
+        }
+        for (size_t i = 0; i < phaseTasks.size(); i++) {
+            tasks.push_back(phaseTasks[i].get());
+            processings.push_back(phaseProcessings[i].get());
+        }
         LogInfo("Tasks to run: ", tasks.size());
-        
-        results.resize(tasks.size());
-        taskID = threadNum;
-        auto progress = std::thread(progressFct, std::cref(results));
-        if (threadNum == 1) {
-            runTask(tasks, results, 0);
-        } else {
-            for (int i = 0; i<threadNum; i++) {
-                threads.push_back(std::thread(runTask, std::cref(tasks), std::ref(results), i));
+
+        size_t count = tasks.size();
+        std::vector<std::vector<size_t>> dependents(count);
+        auto waitingFor = std::make_unique<std::atomic<size_t>[]>(count);
+        for (size_t i = 0; i < count; i++) {
+            waitingFor[i] = dependsOn[i].size();
+            for (auto && dependency : dependsOn[i]) {
+                dependents[dependency].push_back(i);
             }
-            for (int i = 0; i<threadNum; i++) {
-                threads[i].join();
+        }
+        // expected time from start of task to end of its longest chain of dependents, in reverse topological order
+        std::vector<size_t> order;
+        {
+            std::vector<size_t> waiting(count);
+            for (size_t i = 0; i < count; i++) {
+                waiting[i] = dependsOn[i].size();
+                if (waiting[i] == 0) {
+                    order.push_back(i);
+                }
+            }
+            for (size_t next = 0; next < order.size(); next++) {
+                for (auto && dependent : dependents[order[next]]) {
+                    if (--waiting[dependent] == 0) {
+                        order.push_back(dependent);
+                    }
+                }
+            }
+        }
+        std::vector<double> chain(count);
+        std::vector<long> expectedMemory(count);
+        {
+            std::lock_guard<std::mutex> lock(recordsMutex);
+            for (size_t i = 0; i < count; i++) {
+                expectedMemory[i] = history.expectedMemoryKiB(tasks[i]->getDescr());
+            }
+            for (auto it = order.rbegin(); it != order.rend(); ++it) {
+                double longestDependent = 0;
+                for (auto && dependent : dependents[*it]) {
+                    longestDependent = std::max(longestDependent, chain[dependent]);
+                }
+                chain[*it] = history.estimate(tasks[*it]->getDescr()) + longestDependent;
             }
         }
+        auto longestFirst = [&chain](size_t a, size_t b) {
+            return chain[a] > chain[b];
+        };
+        for (auto && taskDependents : dependents) {
+            // started from executor thread, the last submitted runs first
+            std::stable_sort(taskDependents.rbegin(), taskDependents.rend(), longestFirst);
+        }
+
+        results.resize(count);
+        auto progress = std::thread([&]{
+            progressFct(phase, results);
+        });
+        // executor is shared with other runs, so finished tasks of this run are counted
+        std::mutex doneMutex;
+        std::condition_variable allDone;
+        size_t done = 0;
+        std::function<void(size_t)> start = [&](size_t i) {
+            executor.submit([&, i]{
+                if (!memoryBudget.admit(expectedMemory[i], chain[i], [&start, i]{ start(i); })) {
+                    // lighter tasks run meanwhile
+                    return;
+                }
+                runTask(*tasks[i], results[i], [&, i]{
+                    auto retry = memoryBudget.release(expectedMemory[i]);
+                    for (auto it = retry.rbegin(); it != retry.rend(); ++it) {
+                        (*it)();
+                    }
+                    for (auto && dependent : dependents[i]) {
+                        if (--waitingFor[dependent] == 0) {
+                            start(dependent);
+                        }
+                    }
+                    // follow-up on local deque, other threads can steal it
+                    executor.submit([&, i]{
+                        processTask(*tasks[i], *processings[i], results[i]);
+                        std::lock_guard<std::mutex> lock(doneMutex);
+                        if (++done == count) {
+                            allDone.notify_all();
+                        }
+                    });
+                });
+            });
+        };
+        std::vector<size_t> ready;
+        for (size_t i = 0; i < count; i++) {
+            if (dependsOn[i].empty()) {
+                ready.push_back(i);
+            }
+        }
+        std::stable_sort(ready.begin(), ready.end(), longestFirst);
+        for (auto && i : ready) {
+            start(i);
+        }
+        {
+            std::unique_lock<std::mutex> lock(doneMutex);
+            allDone.wait(lock, [&]{ return done == count; });
+        }
         progress.join();
+        recordResults(phase, builds.size(), results);
     };
 
+    if (options.cgroups && initCgroups()) {
+        setSignalCleanup(finishCgroupsOnSignal);
+    }
+
     GitWrapper git = GitWrapper(".");
+    if (options.history) {
+        history = DurationHistory(git.getGitDir() + "git-verify-durations");
+    }
+    TreeCache treeCache(git, git.getGitDir() + "git-verify-trees/");
+    try {
+        treeCache.removeStaleRevisionDirs();
+    } catch (std::runtime_error & e) {
+        LogErr(e.what());
+    }
+
+    // started while changes are still read, deques keep references of running tasks valid
+    std::deque<TaskPtr> streamedTasks;
+    std::deque<std::unique_ptr<Processing>> streamedProcessings;
+    std::deque<TaskResult> streamedResults;
+    std::mutex streamedMutex;
+    std::condition_variable allStreamedDone;
+    size_t streamedDone = 0;
+    std::function<void(Task *, Processing *, TaskResult *, double, long)> startStreamed =
+            [&](Task * task, Processing * processing, TaskResult * result, double priority, long memoryKiB) {
+        executor.submit([=, &startStreamed, &executor, &memoryBudget, &streamedMutex, &allStreamedDone, &streamedDone]{
+            if (!memoryBudget.admit(memoryKiB, priority, [=, &startStreamed]{ startStreamed(task, processing, result, priority, memoryKiB); })) {
+                return;
+            }
+            runTask(*task, *result, [=, &executor, &memoryBudget, &streamedMutex, &allStreamedDone, &streamedDone]{
+                auto retry = memoryBudget.release(memoryKiB);
+                for (auto it = retry.rbegin(); it != retry.rend(); ++it) {
+                    (*it)();
+                }
+                executor.submit([=, &streamedMutex, &allStreamedDone, &streamedDone]{
+                    processTask(*task, *processing, *result);
+                    std::lock_guard<std::mutex> lock(streamedMutex);
+                    streamedDone++;
+                    allStreamedDone.notify_all();
+                });
+            });
+        });
+    };
+    auto stream = [&](TaskPtr task, std::unique_ptr<Processing> processing) {
+        double priority;
+        long memoryKiB;
+        {
+            std::lock_guard<std::mutex> lock(recordsMutex);
+            priority = history.estimate(task->getDescr());
+            memoryKiB = history.expectedMemoryKiB(task->getDescr());
+        }
+        TaskResult * result;
+        {
+            std::lock_guard<std::mutex> lock(streamedMutex);
+            result = &streamedResults.emplace_back();
+        }
+        startStreamed(task.get(), processing.get(), result, priority, memoryKiB);
+        streamedTasks.push_back(std::move(task));
+        streamedProcessings.push_back(std::move(processing));
+    };
     auto crateor = TasksCreator(config, &git);
-    TaskPhases phases = crateor.create();
+    TaskPhases phases = crateor.create(stream);
     int resultStatus = 0;
     
-    auto runBuild = [&phases, &runTasks, &resultStatus]() {
-        if (phases.build.size()) {
-            std::vector<TaskResult> resultsForBuild;
-            runTasks(phases.build, resultsForBuild, 1);
-            int i = 0;
-            for (auto && result : resultsForBuild) {
-                auto & processing = phases.processingBuild[i];
-                Messages msgs = processing->process(result.msgs, result.status);
-                int status = processing->getStatus();
-                resultStatus |= status;
-                for (auto && msg : msgs) {
-                    print_msg(msg);
-                }
-                i++;
-            }
+    unsigned cancelledCount = 0;
+    unsigned timeoutCount = 0;
+    /// @param printStatus log status and name of every task
+    auto report = [&resultStatus, &cancelledCount, &timeoutCount](TaskResult & result, bool printStatus) {
+        if (result.runStatus == RunStatus::CANCELLED) {
+            cancelledCount++;
+            return;
+        }
+        if (result.runStatus == RunStatus::TIMEOUT) {
+            timeoutCount++;
+        }
+        resultStatus |= result.status;
+        if (result.reported) {
+            return;
+        }
+        if (result.runStatus != RunStatus::EXITED) {
+            const char * reason = result.runStatus == RunStatus::TIMEOUT ? "TIMEOUT " : "OOM KILLED ";
+            LogErr(reason, result.descr.taskTypeName, ": \"", result.descr.fileName, "\"");
+        } else if (printStatus) {
+            LogInfo("STATUS: ", result.status);
+            LogInfo(result.descr.taskTypeName, ": \"", result.descr.fileName, "\"");
+        }
+        for (auto && msg : result.msgs) {
+            print_msg(msg);
         }
     };
-    
-    HeadData headData = git.getHeadSha();
-    if (phases.forOld.size()) {
-        if (git.canCheckout(config.remoteSha)) {
-            LogInfo("chackout ",config.remoteSha);
-            git.doCheckout(config.remoteSha);
-            std::vector<TaskResult> resultsForOld;
-            runBuild();
-            runTasks(phases.forOld, resultsForOld);
-            LogInfo("checkout HEAD ", headData.refName, "(", headData.sha, ")");
-            int i = 0;
-            for (auto && result : resultsForOld) {
-                auto & processing = phases.processingForOld[i];
-                processing->process(result.msgs, result.status);
-                i++;
+
+    // worktree is not read by these, they run while the other revision is checked out and built
+    std::vector<TaskResult> resultsWithoutWorktree;
+    std::thread withoutWorktree;
+    if (phases.withoutWorktree.size() || streamedResults.size()) {
+        withoutWorktree = std::thread([&]{
+            std::thread progress;
+            if (streamedResults.size()) {
+                progress = std::thread([&]{
+                    progressFct("stream", streamedResults);
+                });
+            }
+            if (phases.withoutWorktree.size()) {
+                runTasks("stdin", Tasks(), Processings(), phases.withoutWorktree, phases.processingWithoutWorktree, phases.dependsWithoutWorktree, resultsWithoutWorktree);
+            }
+            {
+                std::unique_lock<std::mutex> lock(streamedMutex);
+                allStreamedDone.wait(lock, [&]{ return streamedDone == streamedResults.size(); });
+            }
+            if (progress.joinable()) {
+                progress.join();
+            }
+            recordResults("stdin", 0, streamedResults);
+        });
+    }
+
+    // old revision is checked out to own directory, worktree and HEAD stay untouched and both revisions run at once
+    std::vector<TaskResult> resultsForOld;
+    std::string oldRevisionDir;
+    std::atomic<bool> checkoutFailed{false};
+    std::thread oldRevision;
+    if (phases.forOld.size() && !processesCancelled()) {
+        try {
+            oldRevisionDir = treeCache.createRevisionDir();
+        } catch (std::runtime_error & e) {
+            LogErr("cannot create directory for old revision: ", e.what());
+            std::exit(1);
+        }
+        // paths of old revision in output are compared as paths of worktree
+        for (auto && processing : phases.processingForOld) {
+            processing = std::make_unique<ProcessingRelocated>(std::move(processing), oldRevisionDir, git.getWorkDir());
+        }
+        for (auto * tasks : {&phases.buildForOld, &phases.forOld}) {
+            for (auto && task : *tasks) {
+                task->setWorkingDir(oldRevisionDir);
             }
-            git.doCheckoutHead(headData);
-        } else {
-            LogErr("Checkout failed");
-            resultStatus = 1;
         }
+        oldRevision = std::thread([&]{
+            LogInfo("checkout ", config.remoteSha, " to ", oldRevisionDir);
+            try {
+                if (options.treeCache) {
+                    treeCache.checkoutTo(config.remoteSha, oldRevisionDir);
+                } else {
+                    git.checkoutTo(config.remoteSha, oldRevisionDir);
+                }
+            } catch (std::runtime_error & e) {
+                LogErr(e.what());
+                checkoutFailed = true;
+                return;
+            }
+            runTasks("old", phases.buildForOld, phases.processingBuildForOld, phases.forOld, phases.processingForOld, phases.dependsForOld, resultsForOld);
+        });
     }
     
-    runBuild();
-    
     std::vector<TaskResult> results;
-    runTasks(phases.forNew, results);
+    runTasks("new", phases.build, phases.processingBuild, phases.forNew, phases.processingForNew, phases.dependsForNew, results);
+    if (oldRevision.joinable()) {
+        oldRevision.join();
+        treeCache.verify(oldRevisionDir);
+        std::error_code error;
+        std::filesystem::remove_all(oldRevisionDir, error);
+    }
+    if (checkoutFailed) {
+        LogErr("Checkout failed");
+        resultStatus = 1;
+    }
+    for (size_t i = 0; i < resultsForOld.size(); i++) {
+        // diff of both revisions is reported by the later finished half, mostly by the new one
+        report(resultsForOld[i], i >= phases.buildForOld.size());
+    }
+    for (size_t i = 0; i < results.size(); i++) {
+        report(results[i], i >= phases.build.size());
+    }
+    if (withoutWorktree.joinable()) {
+        withoutWorktree.join();
+    }
+    for (auto && result : streamedResults) {
+        report(result, true);
+    }
+    for (auto && result : resultsWithoutWorktree) {
+        report(result, true);
+    }
+    if (failFast && cancelledCount) {
+        LogErr("fail-fast, cancelled tasks: ", cancelledCount);
+    }
+    if (timeoutCount && globalDeadlinePassed()) {
+        LogErr("deadline passed, tasks killed or not started: ", timeoutCount);
+    }
 
-    {
-        int i = 0;
-        for(auto && result : results) {
-            auto & processing = phases.processingForNew[i];
-            Messages msgs = processing->process(result.msgs, result.status);
-            int status = processing->getStatus();
-            LogInfo("STATUS: ", status);
-            LogInfo(result.descr.taskTypeName, ": \"", result.descr.fileName, "\"");
-            resultStatus |= status;
-            for (auto && msg : msgs) {
-                print_msg(msg);
-            }
-            i++;
-        }
+    // workers leave their cgroups
+    phases = TaskPhases();
+    finishCgroups();
+    finishJobserver();
+
+    printUsageSummary(usageRecords);
+    if (options.usageReport.size() && !writeUsageReport(options.usageReport, usageRecords)) {
+        LogErr("cannot write usage report: ", options.usageReport);
+    }
+    if (!history.save()) {
+        LogErr("cannot write task durations in git directory");
     }
 
     return resultStatus ? 1 : 0;
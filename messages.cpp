@@ -0,0 +1,289 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "messages.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+namespace {
+    std::atomic<size_t> perListLimit{16 * 1024 * 1024};
+    std::atomic<size_t> totalLimit{256 * 1024 * 1024};
+    std::atomic<size_t> totalMemory{0};
+
+    constexpr size_t spillChunk = 64 * 1024;
+    /// spill record: type byte, 8 bytes of length, text
+    constexpr size_t recordHeader = 1 + sizeof(uint64_t);
+
+    /// one file for all lists, lists reserve regions at its end
+    std::mutex spillMutex;
+    int spillFd = -1;
+    bool spillFailed = false;
+    std::atomic<uint64_t> spillFileEnd{0};
+
+    size_t memoryOf(const Message & msg) {
+        return sizeof(Message) + msg.second.size();
+    }
+
+    /// @return -1 if spill file cannot be created, error is logged once
+    int sharedSpillFd() {
+        std::lock_guard<std::mutex> lock(spillMutex);
+        if (spillFd >= 0 || spillFailed) {
+            return spillFd;
+        }
+        const char * dir = std::getenv("TMPDIR");
+        std::string tmpDir = dir && *dir ? dir : "/tmp";
+#ifdef O_TMPFILE
+        spillFd = ::open(tmpDir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+        if (spillFd == -1) {
+            std::string path = tmpDir + "/git-verify-output-XXXXXX";
+            spillFd = ::mkostemp(path.data(), O_CLOEXEC);
+            if (spillFd >= 0) {
+                ::unlink(path.c_str());
+            }
+        }
+        if (spillFd == -1) {
+            spillFailed = true;
+            LogErr("cannot create output spill file in ", tmpDir, ": ", std::strerror(errno), ", output over memory limits is dropped");
+        }
+        return spillFd;
+    }
+
+    void spillWriteFailed() {
+        std::lock_guard<std::mutex> lock(spillMutex);
+        if (!spillFailed) {
+            spillFailed = true;
+            LogErr("output spill write failed: ", std::strerror(errno), ", output over memory limits is dropped");
+        }
+    }
+}
+
+Messages::Messages(std::initializer_list<Message> init) {
+    for (auto && msg : init) {
+        push_back(msg);
+    }
+}
+
+Messages::~Messages() {
+    release();
+}
+
+Messages::Messages(Messages && other) noexcept {
+    *this = std::move(other);
+}
+
+Messages & Messages::operator=(Messages && other) noexcept {
+    if (this != &other) {
+        release();
+        lines = std::move(other.lines);
+        memoryBytes = other.memoryBytes;
+        spillExtents = std::move(other.spillExtents);
+        spillFileSize = other.spillFileSize;
+        spillBuffer = std::move(other.spillBuffer);
+        spilledCount = other.spilledCount;
+        bufferedCount = other.bufferedCount;
+        droppedCount = other.droppedCount;
+        other.lines.clear();
+        other.memoryBytes = 0;
+        other.spillExtents.clear();
+        other.spillFileSize = 0;
+        other.spillBuffer.clear();
+        other.spilledCount = 0;
+        other.bufferedCount = 0;
+        other.droppedCount = 0;
+    }
+    return *this;
+}
+
+void Messages::release() {
+    totalMemory -= memoryBytes;
+    memoryBytes = 0;
+    lines.clear();
+    // space of file is given back, regions of other lists are kept
+    for (auto && extent : spillExtents) {
+        ::fallocate(spillFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, extent.offset, extent.size);
+    }
+    spillExtents.clear();
+    spillFileSize = 0;
+    spillBuffer.clear();
+    spilledCount = 0;
+    bufferedCount = 0;
+    droppedCount = 0;
+}
+
+void Messages::push_back(Message msg) {
+    size_t msgMemory = memoryOf(msg);
+    // once spilled, all next lines are spilled too, order is kept
+    bool overLimit = memoryBytes + msgMemory > perListLimit || totalMemory + msgMemory > totalLimit;
+    if (spilledCount || droppedCount || overLimit) {
+        if (droppedCount || !spill(msg)) {
+            droppedCount++;
+        }
+        return;
+    }
+    memoryBytes += msgMemory;
+    totalMemory += msgMemory;
+    lines.push_back(std::move(msg));
+}
+
+void Messages::append(Messages && other) {
+    if (empty()) {
+        *this = std::move(other);
+        return;
+    }
+    for (auto && msg : other.lines) {
+        push_back(std::move(msg));
+    }
+    if (other.spilledCount) {
+        auto it = const_iterator(&other, other.lines.size());
+        auto end = const_iterator(&other, other.storedCount());
+        for (; it != end; ++it) {
+            push_back(*it);
+        }
+    }
+    droppedCount += other.droppedCount;
+    other.release();
+}
+
+bool Messages::spill(const Message & msg) {
+    if (sharedSpillFd() == -1) {
+        return false;
+    }
+    uint64_t length = msg.second.size();
+    spillBuffer.push_back(static_cast<char>(msg.first));
+    spillBuffer.append(reinterpret_cast<const char *>(&length), sizeof(length));
+    spillBuffer.append(msg.second);
+    spilledCount++;
+    bufferedCount++;
+    if (spillBuffer.size() >= spillChunk) {
+        flushSpill();
+    }
+    return true;
+}
+
+void Messages::flushSpill() {
+    uint64_t offset = spillFileEnd.fetch_add(spillBuffer.size());
+    size_t written = 0;
+    while (written < spillBuffer.size()) {
+        ssize_t n = ::pwrite(spillFd, spillBuffer.data() + written, spillBuffer.size() - written, offset + written);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            // lines of buffer are lost, next lines are dropped too
+            spillWriteFailed();
+            ::fallocate(spillFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, written);
+            spilledCount -= bufferedCount;
+            droppedCount += bufferedCount;
+            bufferedCount = 0;
+            spillBuffer.clear();
+            return;
+        }
+        written += n;
+    }
+    if (spillExtents.size() && spillExtents.back().offset + spillExtents.back().size == offset) {
+        spillExtents.back().size += written;
+    } else {
+        spillExtents.push_back({offset, written});
+    }
+    spillFileSize += written;
+    bufferedCount = 0;
+    spillBuffer.clear();
+}
+
+size_t Messages::readSpilled(size_t offset, char * dst, size_t size) const {
+    size_t done = 0;
+    // offset is in bytes of this list, extents of earlier bytes are skipped
+    size_t extentStart = 0;
+    for (auto && extent : spillExtents) {
+        while (done < size && offset + done < extentStart + extent.size) {
+            size_t inExtent = offset + done - extentStart;
+            ssize_t n = ::pread(spillFd, dst + done, std::min(size - done, extent.size - inExtent), extent.offset + inExtent);
+            if (n <= 0) {
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                LogErr("output spill read failed: ", std::strerror(errno));
+                std::exit(1);
+            }
+            done += n;
+        }
+        extentStart += extent.size;
+    }
+    if (done < size && offset + done >= spillFileSize) {
+        size_t bufferOffset = offset + done - spillFileSize;
+        size_t n = std::min(size - done, spillBuffer.size() - std::min(bufferOffset, spillBuffer.size()));
+        std::memcpy(dst + done, spillBuffer.data() + bufferOffset, n);
+        done += n;
+    }
+    return done;
+}
+
+void Messages::setMemoryLimits(size_t perList, size_t total) {
+    perListLimit = perList;
+    totalLimit = total;
+}
+
+Messages::const_iterator::const_iterator(const Messages * owner, size_t index) : owner(owner), index(index) {
+    load();
+}
+
+Messages::const_iterator & Messages::const_iterator::operator++() {
+    index++;
+    load();
+    return *this;
+}
+
+void Messages::const_iterator::load() {
+    if (index < owner->lines.size() || index >= owner->size()) {
+        return;
+    }
+    if (index == owner->storedCount()) {
+        current = {MessageType::ERR, "... " + std::to_string(owner->droppedCount) + " lines of output dropped, over memory limits and not spilled"};
+        return;
+    }
+    // next spilled record, read ahead in chunks
+    auto ensure = [this](size_t size) {
+        if (buffer.size() - bufferPos >= size) {
+            return;
+        }
+        buffer.erase(0, bufferPos);
+        bufferPos = 0;
+        size_t have = buffer.size();
+        size_t want = std::max(size - have, spillChunk);
+        buffer.resize(have + want);
+        size_t n = owner->readSpilled(offset, buffer.data() + have, want);
+        buffer.resize(have + n);
+        offset += n;
+    };
+    ensure(recordHeader);
+    uint64_t length = 0;
+    current.first = static_cast<MessageType>(buffer[bufferPos]);
+    std::memcpy(&length, buffer.data() + bufferPos + 1, sizeof(length));
+    bufferPos += recordHeader;
+    ensure(length);
+    current.second.assign(buffer, bufferPos, length);
+    bufferPos += length;
+}
@@ -20,19 +20,118 @@
 
 #include "log.h"
 #include "gitWrapper.h"
+#include <algorithm>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
 #include <regex>
+#include <unordered_map>
+#include <initializer_list>
+#include <iterator>
 
 enum class MessageType {
     NORMAL,
     ERR
 };
 using Message = std::pair<MessageType, std::string>;
-using Messages = std::vector<Message>;
 
-inline void print_msg(Message msg) {
+/**
+ * Output lines of task, kept in order.
+ * Lines are held in memory up to per list and global limits, next lines are spilled to unlinked temporary file
+ * shared by all lists. Spilled lines are streamed back by iteration, so processing and printing do not load them all at once.
+ * Lines which cannot be spilled are dropped and counted, iteration ends with a line telling how many.
+ */
+class Messages {
+    /// region of shared spill file
+    struct Extent {
+        uint64_t offset;
+        size_t size;
+    };
+    std::vector<Message> lines;     ///< head kept in memory
+    size_t memoryBytes = 0;
+    std::vector<Extent> spillExtents;   ///< records already written, in order
+    size_t spillFileSize = 0;       ///< bytes in spillExtents
+    std::string spillBuffer;        ///< records not yet written to spill file
+    size_t spilledCount = 0;
+    size_t bufferedCount = 0;       ///< of spilledCount, in spillBuffer
+    size_t droppedCount = 0;
+
+    bool spill(const Message & msg);
+    void flushSpill();
+    void release();
+    /// lines in memory and spilled, without line about dropped ones
+    size_t storedCount() const {
+        return lines.size() + spilledCount;
+    }
+    /// read spilled records from offset, both from file and from not flushed buffer
+    size_t readSpilled(size_t offset, char * dst, size_t size) const;
+public:
+    class const_iterator {
+        const Messages * owner = nullptr;
+        size_t index = 0;
+        size_t offset = 0;          ///< next record in spill
+        std::string buffer;         ///< spilled data read ahead
+        size_t bufferPos = 0;
+        Message current;
+        void load();
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = Message;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Message *;
+        using reference = const Message &;
+
+        const_iterator() = default;
+        const_iterator(const Messages * owner, size_t index);
+        reference operator*() const {
+            return index < owner->lines.size() ? owner->lines[index] : current;
+        }
+        pointer operator->() const {
+            return &**this;
+        }
+        const_iterator & operator++();
+        bool operator==(const const_iterator & other) const {
+            return index == other.index;
+        }
+        bool operator!=(const const_iterator & other) const {
+            return index != other.index;
+        }
+    };
+
+    Messages() = default;
+    Messages(std::initializer_list<Message> init);
+    ~Messages();
+    Messages(Messages && other) noexcept;
+    Messages & operator=(Messages && other) noexcept;
+    Messages(const Messages &) = delete;
+    Messages & operator=(const Messages &) = delete;
+
+    void push_back(Message msg);
+    /// move all lines of other to the end
+    void append(Messages && other);
+    size_t size() const {
+        return storedCount() + (droppedCount ? 1 : 0);
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+    const_iterator begin() const {
+        return const_iterator(this, 0);
+    }
+    const_iterator end() const {
+        return const_iterator(this, size());
+    }
+
+    /**
+     * @param perList bytes of one list kept in memory
+     * @param total bytes of all lists kept in memory
+     */
+    static void setMemoryLimits(size_t perList, size_t total);
+};
+
+inline void print_msg(const Message & msg) {
     if (msg.first == MessageType::NORMAL) {
         Log<1>(msg.second, '\n');
     } else {
@@ -45,14 +144,17 @@ protected:
     int status;
 public:
     Processing() = default;
-    virtual Messages process(const Messages & messages, int status) = 0;
+    /// @param messages output of task, moved in
+    virtual Messages process(Messages messages, int status) = 0;
     int getStatus() {return status;}
+    /// result is reported with result of other task, after process()
+    virtual bool reportedByOther() {return false;}
 };
 
 class ProcessingNoop : public Processing {
 public:
     ProcessingNoop() = default;
-    Messages process(const Messages & messages, int status) override {
+    Messages process(Messages messages, int status) override {
         this->status = status;
         return messages;
     }
@@ -61,7 +163,7 @@ public:
 class ProcessingReturnValue : public Processing {
 public:
     ProcessingReturnValue() = default;
-    Messages process(const Messages & messages, int status) override {
+    Messages process(Messages messages, int status) override {
         this->status = status;
         if (status) {
             return messages;
@@ -77,7 +179,7 @@ public:
         this->matchForSuccess = matchForSuccess;
         this->match = std::regex(match);
     }
-    Messages process(const Messages & messages, int status) override {
+    Messages process(Messages messages, int status) override {
         (void) status;
         Messages result;
         for ( auto && msg : messages) {
@@ -95,7 +197,9 @@ private:
     bool matchForSuccess;
 };
 
+/// outputs of both halves of diff, halves can be processed by different threads
 struct SharedDiffState {
+    std::mutex mutex;
     int count = 0;
     Messages a;
     Messages b;
@@ -111,21 +215,23 @@ public:
         this->logFilterRegex = std::regex(logFilterRegexStr);
         this->diffState = diffState;
     }
-    Messages process(const Messages & messages, int status) override {
+    Messages process(Messages messages, int status) override {
         (void) status;
+        std::lock_guard<std::mutex> lock(diffState->mutex);
         if (diffPart == DiffPart::A) {
-            diffState->a = messages;
+            diffState->a = std::move(messages);
             LogDev("process diff A");
         } else {
-            diffState->b = messages;
+            diffState->b = std::move(messages);
             LogDev("process diff B");
         }
         if (diffState->count == 0) {
-            this->status = 1;
+            // result is known and reported by the other half
+            this->status = 0;
+            this->forwarded = true;
             diffState->count = 1;
             return {};
         } else {
-            Messages diffMesgs;
             auto logA = std::string();
             auto logB = std::string();
             for (auto && row : diffState->a) {
@@ -138,46 +244,153 @@ public:
                 logB.append(line);
                 logB.append("\n");
             }
-            int changedCount = 0;
+            // added lines are sorted, B is streamed once: added lines with context, "..." for skipped lines
+            std::vector<int> added = GitWrapper::compareLogs(logA, logB);
             constexpr int contextSize = 3;
-            bool realAdded = false;
-            int lastAddedId = -1;
-            Messages & msgB = diffState->b;
-            for (auto && lineNo : GitWrapper::compareLogs(logA, logB)) {
-                msgB[lineNo-1].first = MessageType::ERR;
-                if (realAdded && lastAddedId < lineNo - 1 - contextSize) {
-                    int contextBound = lastAddedId + contextSize;
-                    while (lastAddedId < contextBound) {
-                        lastAddedId++;
-                        diffMesgs.push_back(msgB[lastAddedId]);
-                    }
-                }
-                if (lastAddedId < lineNo - 1 - contextSize) {
-                    lastAddedId = std::max(-1, lineNo - 1 - contextSize - 1);
-                    if (lastAddedId >= 0) {
-                        diffMesgs.push_back(std::make_pair(MessageType::NORMAL, "..."));
-                    }
+            Messages diffMesgs;
+            size_t addedId = 0;
+            int prevAdded = -1 - contextSize;
+            bool lastShown = false;
+            int lineId = 0;
+            for (auto && row : diffState->b) {
+                while (addedId < added.size() && added[addedId] - 1 < lineId) {
+                    prevAdded = added[addedId] - 1;
+                    addedId++;
                 }
-                while (lastAddedId < lineNo - 1) {
-                    lastAddedId++;
-                    diffMesgs.push_back(msgB[lastAddedId]);
+                bool hasNext = addedId < added.size();
+                bool isAdded = hasNext && added[addedId] - 1 == lineId;
+                bool shown = lineId <= prevAdded + contextSize || (hasNext && added[addedId] - 1 - contextSize <= lineId);
+                if (!shown && !hasNext) {
+                    break;
                 }
-                realAdded = true;
-                changedCount++;
-            }
-            if (realAdded) {
-                int contextBound = std::min(lastAddedId + contextSize, (int)msgB.size() - 1);
-                while (lastAddedId < contextBound) {
-                    lastAddedId++;
-                    diffMesgs.push_back(msgB[lastAddedId]);
+                if (shown) {
+                    if (!lastShown && lineId > 0) {
+                        diffMesgs.push_back({MessageType::NORMAL, "..."});
+                    }
+                    diffMesgs.push_back({isAdded ? MessageType::ERR : row.first, row.second});
                 }
+                lastShown = shown;
+                lineId++;
             }
-            this->status = changedCount ? 1 : 0;
+            this->status = added.size() ? 1 : 0;
             return diffMesgs;
         }
     }
+    bool reportedByOther() override {
+        return forwarded;
+    }
 private:
     std::shared_ptr<SharedDiffState> diffState;
     DiffPart diffPart;
+    bool forwarded = false;
     std::regex logFilterRegex;
 };
+
+/// output of task run in other directory than worktree, paths of the directory are rewritten to worktree before processing
+class ProcessingRelocated : public Processing {
+public:
+    /// @param workDir with trailing slash
+    ProcessingRelocated(std::unique_ptr<Processing> processing, const std::string & dir, const std::string & workDir)
+        : processing(std::move(processing)) {
+        std::string workDirNoSlash = workDir.substr(0, workDir.size() - 1);
+        replaces = {{dir + "/", workDir}, {dir, workDirNoSlash}};
+        // as printed relative to worktree
+        if (workDir.size() && dir.rfind(workDir, 0) == 0) {
+            replaces.push_back({dir.substr(workDir.size()) + "/", ""});
+        }
+    }
+    Messages process(Messages messages, int status) override {
+        Messages relocated;
+        for (auto && msg : messages) {
+            std::string line = msg.second;
+            for (auto && [from, to] : replaces) {
+                for (size_t pos = line.find(from); pos != std::string::npos; pos = line.find(from, pos + to.size())) {
+                    line.replace(pos, from.size(), to);
+                }
+            }
+            relocated.push_back({msg.first, std::move(line)});
+        }
+        auto result = processing->process(std::move(relocated), status);
+        this->status = processing->getStatus();
+        return result;
+    }
+    bool reportedByOther() override {
+        return processing->reportedByOther();
+    }
+private:
+    std::unique_ptr<Processing> processing;
+    std::vector<std::pair<std::string, std::string>> replaces;
+};
+
+/// output of one process checking many files, split to files and processed per file
+class ProcessingBatch : public Processing {
+public:
+    struct Entry {
+        std::string fileName;
+        std::unique_ptr<Processing> processing;
+    };
+    explicit ProcessingBatch(std::vector<Entry> && entries) : entries(std::move(entries)) {
+        for (size_t i = 0; i < this->entries.size(); i++) {
+            fileIds[this->entries[i].fileName] = i;
+            maxNameSize = std::max(maxNameSize, this->entries[i].fileName.size());
+        }
+    }
+    Messages process(Messages messages, int status) override {
+        // line starting with file name (as "<file>:<line>:...") begins messages of that file,
+        // following lines without file name are continuation of previous file messages
+        Messages general;
+        std::vector<Messages> perFile(entries.size());
+        Messages * current = &general;
+        for (auto && msg : messages) {
+            size_t fileId = findFile(msg.second);
+            if (fileId < entries.size()) {
+                current = &perFile[fileId];
+            }
+            current->push_back(msg);
+        }
+        bool anyAttributed = false;
+        for (auto && fileMsgs : perFile) {
+            anyAttributed |= !fileMsgs.empty();
+        }
+        Messages result = std::move(general);
+        this->status = 0;
+        forwarded = result.empty();
+        for (size_t i = 0; i < entries.size(); i++) {
+            // failure without any file name in output fails all files
+            int fileStatus = status && (!perFile[i].empty() || !anyAttributed) ? status : 0;
+            auto & processing = entries[i].processing;
+            Messages fileResult = processing->process(std::move(perFile[i]), fileStatus);
+            this->status |= processing->getStatus();
+            forwarded = forwarded && processing->reportedByOther();
+            if (!fileResult.empty()) {
+                result.push_back({MessageType::NORMAL, "--- " + entries[i].fileName});
+                result.append(std::move(fileResult));
+            }
+        }
+        return result;
+    }
+    /// all files are reported by other batch
+    bool reportedByOther() override {
+        return forwarded;
+    }
+private:
+    std::vector<Entry> entries;
+    std::unordered_map<std::string, size_t> fileIds;
+    size_t maxNameSize = 0;
+    bool forwarded = false;
+
+    /// longest file name of batch followed by ':' or '(' at start of line, names may contain spaces
+    /// @return index of entry, entries.size() if line does not start with a file name
+    size_t findFile(const std::string & line) const {
+        size_t start = line.rfind("./", 0) == 0 ? 2 : 0;
+        size_t found = entries.size();
+        size_t end = std::min(line.size(), start + maxNameSize + 1);
+        for (size_t pos = line.find_first_of(":(", start); pos < end; pos = line.find_first_of(":(", pos + 1)) {
+            auto it = fileIds.find(line.substr(start, pos - start));
+            if (it != fileIds.end()) {
+                found = it->second;
+            }
+        }
+        return found;
+    }
+};
@@ -0,0 +1,567 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "process.h"
+#include "pstream/pstream.h"
+#include "log.h"
+
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+extern char ** environ;
+
+namespace {
+    Launcher currentLauncher = Launcher::SPAWN;
+    Clock::time_point globalDeadline = Clock::time_point::max();
+    std::atomic<bool> cancelled{false};
+    /// stays readable after cancel, every I/O loop polls it
+    const int cancelFd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    /// process groups of running children, lock free for use in signal handler
+    std::atomic<pid_t> runningGroups[4096];
+
+    void registerGroup(pid_t pgid) {
+        for (auto && group : runningGroups) {
+            pid_t empty = 0;
+            if (group.compare_exchange_strong(empty, pgid)) {
+                return;
+            }
+        }
+    }
+
+    void unregisterGroup(pid_t pgid) {
+        for (auto && group : runningGroups) {
+            pid_t expected = pgid;
+            if (group.compare_exchange_strong(expected, 0)) {
+                return;
+            }
+        }
+    }
+
+    std::atomic<void (*)()> signalCleanup{nullptr};
+
+    void forwardSignal(int signal) {
+        for (auto && group : runningGroups) {
+            pid_t pgid = group.load();
+            if (pgid > 0) {
+                ::killpg(pgid, signal);
+                // background jobs of non-interactive shells ignore SIGINT
+                if (signal != SIGTERM) {
+                    ::killpg(pgid, SIGTERM);
+                }
+            }
+        }
+        if (auto cleanup = signalCleanup.load()) {
+            cleanup();
+        }
+        ::signal(signal, SIG_DFL);
+        ::raise(signal);
+    }
+
+    struct CommandLine {
+        std::string name;
+        std::vector<std::string> args;
+    };
+
+    /// without cgroup support in posix_spawn, shell moves itself to cgroup and executes the program
+    CommandLine inCgroup(const std::string & cgroupDir, const std::string & name, const std::vector<std::string> & args) {
+        if (cgroupDir.empty()) {
+            return {name, args};
+        }
+        CommandLine command{"/bin/sh", {"sh", "-c", R"(echo $$ > "$0/cgroup.procs" && exec "$@")", cgroupDir, name}};
+        if (args.size() > 1) {
+            command.args.insert(command.args.end(), args.begin() + 1, args.end());
+        }
+        return command;
+    }
+
+    /// pstreams starts children in current directory, shell changes it and executes the program
+    CommandLine inDirectory(const std::string & dir, CommandLine command) {
+        if (dir.empty()) {
+            return command;
+        }
+        CommandLine wrapped{"/bin/sh", {"sh", "-c", R"(cd "$0" && exec "$@")", dir, command.name}};
+        if (command.args.size() > 1) {
+            wrapped.args.insert(wrapped.args.end(), command.args.begin() + 1, command.args.end());
+        }
+        return wrapped;
+    }
+
+    /// pstreams passes environment of this process, env sets variables before exec of the program
+    CommandLine withEnvironment(const std::vector<std::string> & environment, CommandLine command) {
+        if (environment.empty()) {
+            return command;
+        }
+        CommandLine wrapped{"env", {"env"}};
+        wrapped.args.insert(wrapped.args.end(), environment.begin(), environment.end());
+        wrapped.args.push_back(command.name);
+        if (command.args.size() > 1) {
+            wrapped.args.insert(wrapped.args.end(), command.args.begin() + 1, command.args.end());
+        }
+        return wrapped;
+    }
+
+    /// environ with variables of environment replaced or added
+    std::vector<char*> mergeEnvironment(const std::vector<std::string> & environment) {
+        std::vector<char*> result;
+        for (char ** variable = environ; *variable; variable++) {
+            std::string_view current(*variable);
+            bool replaced = false;
+            for (auto && added : environment) {
+                auto nameSize = added.find('=') + 1;
+                replaced |= current.substr(0, nameSize) == std::string_view(added).substr(0, nameSize);
+            }
+            if (!replaced) {
+                result.push_back(*variable);
+            }
+        }
+        for (auto && added : environment) {
+            result.push_back(const_cast<char*>(added.c_str()));
+        }
+        result.push_back(nullptr);
+        return result;
+    }
+
+    /// pstreambuf with access to the raw pipes
+    class PstreamBuf : public redi::pstreambuf {
+    public:
+        fd_type & inFd() { return wpipe(); }
+        fd_type outFd() { return rpipe(rsrc_out); }
+        fd_type errFd() { return rpipe(rsrc_err); }
+    };
+
+    class PstreamProcess : public ChildProcess {
+        PstreamBuf buf;
+    public:
+        bool start(const std::string & name, const std::vector<std::string> & args, bool withStdin, int stdinFd) override {
+            (void) stdinFd;     // unsupported
+            using redi::pstreams;
+            auto mode = pstreams::pstdout | pstreams::pstderr | pstreams::newpg | (withStdin ? pstreams::pstdin : pstreams::pmode());
+            auto command = withEnvironment(environment, inDirectory(workingDir, inCgroup(cgroupDir, name, args)));
+            startTime = Clock::now();
+            if (!buf.open(command.name, command.args, mode)) {
+                return false;
+            }
+            registerGroup(buf.pid());
+            return true;
+        }
+        bool supportsStdinFd() const override {
+            return false;
+        }
+        int wait() override {
+            if (buf.pid() > 0) {
+                unregisterGroup(buf.pid());
+            }
+            bool running = buf.is_open();
+            buf.close();
+            if (running) {
+                setUsage(buf.rusage());
+            }
+            return buf.status();
+        }
+        int error() const override { return buf.error(); }
+        pid_t pid() const override { return buf.pid(); }
+        int & inFd() override { return buf.inFd(); }
+        int outFd() const override { return const_cast<PstreamBuf&>(buf).outFd(); }
+        int errFd() const override { return const_cast<PstreamBuf&>(buf).errFd(); }
+    };
+
+    /// posix_spawn() based child, glibc uses clone(CLONE_VM|CLONE_VFORK) so cost does not depend on parent memory size
+    class SpawnProcess : public ChildProcess {
+        pid_t childPid = 0;
+        int in = -1;
+        int out = -1;
+        int err = -1;
+        int errorNo = 0;
+        int status = -1;
+
+        void closeFd(int & fd) {
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+    public:
+        ~SpawnProcess() override {
+            if (childPid > 0) {
+                wait();
+            }
+        }
+        bool start(const std::string & name, const std::vector<std::string> & args, bool withStdin, int stdinFd) override {
+            enum { RD, WR };
+            int pin[2] = {-1, -1};
+            int pout[2] = {-1, -1};
+            int perr[2] = {-1, -1};
+            // O_CLOEXEC - pipes must not leak to children started concurrently by other threads
+            withStdin = withStdin && stdinFd < 0;
+            if ((withStdin && ::pipe2(pin, O_CLOEXEC)) || ::pipe2(pout, O_CLOEXEC) || ::pipe2(perr, O_CLOEXEC)) {
+                errorNo = errno;
+                for (int fd : {pin[RD], pin[WR], pout[RD], pout[WR], perr[RD], perr[WR]}) {
+                    closeFd(fd);
+                }
+                return false;
+            }
+            posix_spawn_file_actions_t actions;
+            posix_spawn_file_actions_init(&actions);
+            if (stdinFd >= 0) {
+                posix_spawn_file_actions_adddup2(&actions, stdinFd, STDIN_FILENO);
+            } else if (withStdin) {
+                posix_spawn_file_actions_adddup2(&actions, pin[RD], STDIN_FILENO);
+            }
+            posix_spawn_file_actions_adddup2(&actions, pout[WR], STDOUT_FILENO);
+            posix_spawn_file_actions_adddup2(&actions, perr[WR], STDERR_FILENO);
+            if (workingDir.size()) {
+                // glibc 2.29, relative program path is found from the new directory as with cd in shell
+                posix_spawn_file_actions_addchdir_np(&actions, workingDir.c_str());
+            }
+
+            auto command = inCgroup(cgroupDir, name, args);
+            std::vector<char*> argv;
+            for (auto && arg : command.args) {
+                argv.push_back(const_cast<char*>(arg.c_str()));
+            }
+            argv.push_back(nullptr);
+
+            posix_spawnattr_t attr;
+            posix_spawnattr_init(&attr);
+            posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+            posix_spawnattr_setpgroup(&attr, 0);
+
+            auto envp = environment.empty() ? std::vector<char*>() : mergeEnvironment(environment);
+
+            startTime = Clock::now();
+            errorNo = posix_spawnp(&childPid, command.name.c_str(), &actions, &attr, argv.data(), envp.empty() ? environ : envp.data());
+            posix_spawnattr_destroy(&attr);
+            posix_spawn_file_actions_destroy(&actions);
+            for (int fd : {pin[RD], pout[WR], perr[WR]}) {
+                closeFd(fd);
+            }
+            in = pin[WR];
+            out = pout[RD];
+            err = perr[RD];
+            if (errorNo) {
+                childPid = 0;
+                status = 127 << 8;  // as shell reports command not found
+                closeFd(in);
+                closeFd(out);
+                closeFd(err);
+                return false;
+            }
+            registerGroup(childPid);
+            return true;
+        }
+        bool supportsStdinFd() const override {
+            return true;
+        }
+        int wait() override {
+            closeFd(in);
+            closeFd(out);
+            closeFd(err);
+            if (childPid > 0) {
+                unregisterGroup(childPid);
+                struct rusage usage = {};
+                while (::wait4(childPid, &status, 0, &usage) == -1 && errno == EINTR) {}
+                setUsage(usage);
+                childPid = 0;
+            }
+            return status;
+        }
+        int error() const override { return errorNo; }
+        pid_t pid() const override { return childPid; }
+        int & inFd() override { return in; }
+        int outFd() const override { return out; }
+        int errFd() const override { return err; }
+    };
+}
+
+int pidfdOpen(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void) pid;
+    return -1;
+#endif
+}
+
+void ChildProcess::setUsage(const struct rusage & usage) {
+    auto seconds = [](const timeval & time) {
+        return time.tv_sec + time.tv_usec / 1e6;
+    };
+    resourceUsage.wallSeconds = std::chrono::duration<double>(Clock::now() - startTime).count();
+    resourceUsage.userSeconds = seconds(usage.ru_utime);
+    resourceUsage.systemSeconds = seconds(usage.ru_stime);
+    resourceUsage.maxRssKiB = usage.ru_maxrss;
+    resourceUsage.inBlocks = usage.ru_inblock;
+    resourceUsage.outBlocks = usage.ru_oublock;
+}
+
+void setLauncher(Launcher launcher) {
+    currentLauncher = launcher;
+}
+
+Launcher getLauncher() {
+    return currentLauncher;
+}
+
+void setGlobalDeadline(Clock::time_point deadline) {
+    globalDeadline = deadline;
+}
+
+Clock::time_point deadlineAfter(double timeout) {
+    if (timeout <= 0) {
+        return globalDeadline;
+    }
+    auto taskDeadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(timeout));
+    return std::min(taskDeadline, globalDeadline);
+}
+
+bool globalDeadlinePassed() {
+    return globalDeadline != Clock::time_point::max() && Clock::now() >= globalDeadline;
+}
+
+RunStatus notStartedStatus() {
+    if (processesCancelled()) {
+        return RunStatus::CANCELLED;
+    }
+    return globalDeadlinePassed() ? RunStatus::TIMEOUT : RunStatus::EXITED;
+}
+
+void cancelAllProcesses() {
+    if (cancelled.exchange(true)) {
+        return;
+    }
+    uint64_t one = 1;
+    if (cancelFd < 0 || ::write(cancelFd, &one, sizeof(one)) != sizeof(one)) {
+        // I/O loops are not woken, terminate the groups directly
+        for (auto && group : runningGroups) {
+            pid_t pgid = group.load();
+            if (pgid > 0) {
+                ::killpg(pgid, SIGTERM);
+            }
+        }
+    }
+}
+
+bool processesCancelled() {
+    return cancelled;
+}
+
+int cancelEventFd() {
+    return cancelFd;
+}
+
+void installSignalForwarding() {
+    struct sigaction action = {};
+    action.sa_handler = forwardSignal;
+    sigemptyset(&action.sa_mask);
+    for (int signal : {SIGINT, SIGTERM, SIGHUP}) {
+        ::sigaction(signal, &action, nullptr);
+    }
+}
+
+void setSignalCleanup(void (*cleanup)()) {
+    signalCleanup = cleanup;
+}
+
+void terminateProcessGroup(ChildProcess & process) {
+    pid_t pgid = process.pid();
+    if (pgid <= 0 || ::killpg(pgid, SIGTERM) == -1) {
+        return;
+    }
+    auto killAt = Clock::now() + terminateGrace;
+    // group leader stays a zombie until wait(), so the group id is not reused meanwhile
+    siginfo_t info;
+    while (Clock::now() < killAt) {
+        info.si_pid = 0;
+        if (::waitid(P_PID, pgid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pgid) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ::killpg(pgid, SIGKILL);
+}
+
+void setNonBlocking(int fd) {
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+ssize_t writeNoSigpipe(int fd, const char * data, size_t size) {
+    sigset_t pipeSet, oldSet;
+    sigemptyset(&pipeSet);
+    sigaddset(&pipeSet, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
+    ssize_t n = ::write(fd, data, size);
+    if (n == -1 && errno == EPIPE) {
+        const timespec noWait = {0, 0};
+        sigtimedwait(&pipeSet, nullptr, &noWait);
+        errno = EPIPE;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldSet, nullptr);
+    return n;
+}
+
+void LineReader::append(const char * data, size_t size) {
+    const char * end = data + size;
+    const char * newLine;
+    while ((newLine = static_cast<const char*>(std::memchr(data, '\n', end - data)))) {
+        unfinished.append(data, newLine);
+        msgs.push_back({msgType, std::move(unfinished)});
+        unfinished.clear();
+        data = newLine + 1;
+    }
+    unfinished.append(data, end);
+}
+
+void LineReader::finish() {
+    if (unfinished.size()) {
+        msgs.push_back({msgType, std::move(unfinished)});
+        unfinished.clear();
+    }
+    eof = true;
+}
+
+bool LineReader::read(int fd) {
+    constexpr size_t size = 64 * 1024;
+    char buf[size];
+    ssize_t n = ::read(fd, buf, size);
+    if (n > 0) {
+        append(buf, n);
+        return true;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return false;
+    }
+    finish();
+    return false;
+}
+
+ChildProcessPtr createChildProcess(Launcher launcher) {
+    switch (launcher) {
+        case Launcher::PSTREAMS:
+            return std::make_unique<PstreamProcess>();
+        case Launcher::SPAWN:
+            break;
+    }
+    return std::make_unique<SpawnProcess>();
+}
+
+ProcessOutput pumpProcess(ChildProcess & process, std::string_view input, Clock::time_point deadline) {
+    int & inFd = process.inFd();
+    int outFd = process.outFd();
+    int errFd = process.errFd();
+    LineReader out(MessageType::NORMAL);
+    LineReader err(MessageType::ERR);
+    out.eof = outFd < 0;
+    err.eof = errFd < 0;
+    for (int fd : {inFd, outFd, errFd}) {
+        if (fd >= 0) {
+            setNonBlocking(fd);
+        }
+    }
+    int pidFd = pidfdOpen(process.pid());
+    size_t written = 0;
+    bool exited = false;
+    auto closeInput = [&inFd]() {
+        if (inFd >= 0) {
+            ::close(inFd);
+            inFd = -1;
+        }
+    };
+
+    ProcessOutput result;
+    bool terminated = false;
+
+    while (!(out.eof && err.eof)) {
+        if (!terminated && cancelled) {
+            result.runStatus = RunStatus::CANCELLED;
+            deadline = Clock::now();
+        }
+        int timeoutMs = -1;
+        if (deadline != Clock::time_point::max()) {
+            auto now = Clock::now();
+            if (now >= deadline) {
+                // SIGTERM at deadline, SIGKILL after grace period, output is drained meanwhile
+                if (result.runStatus == RunStatus::EXITED) {
+                    result.runStatus = RunStatus::TIMEOUT;
+                }
+                closeInput();
+                ::killpg(process.pid(), terminated ? SIGKILL : SIGTERM);
+                deadline = terminated ? Clock::time_point::max() : now + terminateGrace;
+                terminated = true;
+                continue;
+            }
+            timeoutMs = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+        }
+        enum { IN, OUT, ERR, PID, CANCEL, COUNT };
+        pollfd fds[COUNT] = {
+            {inFd, POLLOUT, 0},
+            {out.eof ? -1 : outFd, POLLIN, 0},
+            {err.eof ? -1 : errFd, POLLIN, 0},
+            {exited ? -1 : pidFd, POLLIN, 0},
+            {terminated ? -1 : cancelFd, POLLIN, 0},
+        };
+        if (::poll(fds, COUNT, timeoutMs) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LogErr("poll failed: ", std::strerror(errno));
+            break;
+        }
+        if (fds[IN].revents) {
+            ssize_t n = writeNoSigpipe(inFd, input.data() + written, input.size() - written);
+            if (n > 0) {
+                written += n;
+            }
+            if ((n == -1 && errno != EAGAIN && errno != EINTR) || written == input.size()) {
+                closeInput();
+            }
+        }
+        if (fds[OUT].revents) {
+            out.read(outFd);
+        }
+        if (fds[ERR].revents) {
+            err.read(errFd);
+        }
+        if (fds[PID].revents) {
+            exited = true;
+            closeInput();
+            while (!out.eof && out.read(outFd)) {}
+            while (!err.eof && err.read(errFd)) {}
+            out.finish();
+            err.finish();
+        }
+    }
+    closeInput();
+    if (pidFd >= 0) {
+        ::close(pidFd);
+    }
+    // stdout before stderr, output of the same process is comparable between runs
+    result.msgs = std::move(out.msgs);
+    result.msgs.append(std::move(err.msgs));
+    return result;
+}
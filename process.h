@@ -0,0 +1,188 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "messages.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/types.h>
+
+/// how child processes are started
+enum class Launcher {
+    PSTREAMS,   ///< fork() in redi::pstreambuf
+    SPAWN,      ///< posix_spawn(), vfork-like, no page table copy of the parent
+};
+
+void setLauncher(Launcher launcher);
+Launcher getLauncher();
+
+using Clock = std::chrono::steady_clock;
+
+/// from SIGTERM of process group at deadline to SIGKILL
+constexpr auto terminateGrace = std::chrono::seconds(2);
+
+/// no process runs after global deadline
+void setGlobalDeadline(Clock::time_point deadline);
+/// earlier of now + timeout and global deadline
+/// @param timeout seconds, 0 - no timeout
+Clock::time_point deadlineAfter(double timeout);
+/// tasks picked up later are not started, they fail with TIMEOUT
+bool globalDeadlinePassed();
+
+/// kill process groups of running children when this process gets SIGINT, SIGTERM or SIGHUP
+void installSignalForwarding();
+/// called by signal handler after children are signalled, before this process terminates; must be async-signal-safe
+void setSignalCleanup(void (*cleanup)());
+
+/// terminate running children as at deadline, processes are not started any more
+void cancelAllProcesses();
+bool processesCancelled();
+/// readable after cancelAllProcesses(), for poll() of process I/O loops
+int cancelEventFd();
+
+/// resources used by process and its waited for descendants
+struct ResourceUsage {
+    double wallSeconds = 0;
+    double userSeconds = 0;
+    double systemSeconds = 0;
+    long maxRssKiB = 0;
+    long inBlocks = 0;      ///< 512 B blocks read from storage
+    long outBlocks = 0;     ///< 512 B blocks written to storage
+};
+
+struct rusage;
+
+/// started child process with pipes connected to its standard streams, child leads its own process group
+class ChildProcess {
+protected:
+    Clock::time_point startTime;
+    ResourceUsage resourceUsage;
+    std::string cgroupDir;
+    std::string workingDir;
+    std::vector<std::string> environment;
+    /// fill resourceUsage from rusage of reaped child
+    void setUsage(const struct rusage & usage);
+public:
+    virtual ~ChildProcess() = default;
+    /// child joins cgroup before exec of the program, set before start()
+    void setCgroup(const std::string & dir) {
+        cgroupDir = dir;
+    }
+    /// child runs in directory instead of current one, set before start()
+    void setWorkingDir(const std::string & dir) {
+        workingDir = dir;
+    }
+    /// "NAME=value" set in environment of child, set before start()
+    void setEnvironment(const std::vector<std::string> & variables) {
+        environment = variables;
+    }
+    /// @param withStdin create pipe for stdin
+    /// @param stdinFd used as child stdin instead of pipe, requires supportsStdinFd(), -1 for none
+    /// @return false if process could not be started, see error()
+    virtual bool start(const std::string & name, const std::vector<std::string> & args, bool withStdin, int stdinFd = -1) = 0;
+    virtual bool supportsStdinFd() const = 0;
+    /// close pipes and reap the child
+    /// @return wait status
+    virtual int wait() = 0;
+    virtual int error() const = 0;
+    virtual pid_t pid() const = 0;
+    /// write end of stdin pipe, -1 when closed
+    virtual int & inFd() = 0;
+    virtual int outFd() const = 0;
+    virtual int errFd() const = 0;
+    /// valid after wait()
+    const ResourceUsage & usage() const {
+        return resourceUsage;
+    }
+};
+
+using ChildProcessPtr = std::unique_ptr<ChildProcess>;
+
+ChildProcessPtr createChildProcess(Launcher launcher);
+
+inline ChildProcessPtr createChildProcess() {
+    return createChildProcess(getLauncher());
+}
+
+/// splits stream into lines, keeps only not finished line between reads
+class LineReader {
+    MessageType msgType;
+    std::string unfinished;
+public:
+    Messages msgs;
+    bool eof = false;
+
+    explicit LineReader(MessageType msgType) : msgType(msgType) {}
+    void append(const char * data, size_t size);
+    /// flush not finished line and mark end of stream
+    void finish();
+    /// part of line without new line is buffered
+    bool hasUnfinished() const {
+        return !unfinished.empty();
+    }
+    /// read available data from non blocking fd
+    /// @return false when nothing more can be read now
+    bool read(int fd);
+};
+
+void setNonBlocking(int fd);
+
+/// pollable descriptor of child process, readable after its exit, -1 if kernel lacks pidfd_open
+int pidfdOpen(pid_t pid);
+
+/// write without delivering SIGPIPE to the whole process when child closed its stdin
+ssize_t writeNoSigpipe(int fd, const char * data, size_t size);
+
+/// SIGTERM process group, SIGKILL it when still running after grace period
+void terminateProcessGroup(ChildProcess & process);
+
+/// how process run ended
+enum class RunStatus {
+    EXITED,
+    TIMEOUT,    ///< killed at deadline, or not started after global deadline
+    OOM_KILLED, ///< killed by OOM killer at cgroup memory limit
+    CANCELLED,  ///< not started or killed by cancelAllProcesses(), failure is reported by other task
+};
+
+/// EXITED if task picked up now may start, CANCELLED after cancelAllProcesses(), TIMEOUT after global deadline
+RunStatus notStartedStatus();
+
+struct ProcessResult {
+    int status = -1;
+    Messages msgs;
+    RunStatus runStatus = RunStatus::EXITED;
+    ResourceUsage usage;
+};
+
+struct ProcessOutput {
+    Messages msgs;
+    RunStatus runStatus = RunStatus::EXITED;
+};
+
+/**
+ * Feed stdin, drain stdout and stderr and watch for process exit at the same time.
+ * Blocks in poll() only, child filling its output pipe before reading whole input does not deadlock.
+ * After exit (pidfd) remaining output is drained, descendants keeping pipes open do not block.
+ * stdin is closed when whole input is written.
+ * Process group is terminated at deadline or on cancelAllProcesses().
+ */
+ProcessOutput pumpProcess(ChildProcess & process, std::string_view input, Clock::time_point deadline = Clock::time_point::max());
@@ -0,0 +1,298 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "processLoop.h"
+#include "log.h"
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <cstring>
+
+struct ProcessLoop::Watched {
+    /// epoll data of one descriptor
+    struct Source {
+        Watched * owner;
+        enum Kind {
+            IN,
+            OUT,
+            ERR,
+            PID,
+        } kind;
+    };
+    ChildProcess & process;
+    std::string_view input;
+    size_t written = 0;
+    Clock::time_point deadline;
+    Done done;
+    LineReader out{MessageType::NORMAL};
+    LineReader err{MessageType::ERR};
+    int pidFd = -1;
+    bool exited = false;        ///< pidfd readable, wait() does not block
+    bool terminated = false;
+    bool finished = false;
+    ProcessOutput result;
+    Source sources[4] = {{this, Source::IN}, {this, Source::OUT}, {this, Source::ERR}, {this, Source::PID}};
+    std::list<std::unique_ptr<Watched>>::iterator position;
+
+    Watched(ChildProcess & process, std::string_view input, Clock::time_point deadline, Done done)
+        : process(process), input(input), deadline(deadline), done(std::move(done)) {}
+};
+
+namespace {
+    void control(int epollFd, int op, int fd, uint32_t events, void * data) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.ptr = data;
+        if (::epoll_ctl(epollFd, op, fd, &event) == -1) {
+            LogErr("epoll_ctl failed: ", std::strerror(errno));
+        }
+    }
+}
+
+bool ProcessLoop::supported() {
+    int fd = pidfdOpen(::getpid());
+    if (fd < 0) {
+        return false;
+    }
+    ::close(fd);
+    return true;
+}
+
+ProcessLoop::ProcessLoop(unsigned processes) {
+    // pipes and pidfd of every process, stdin memfd and a margin
+    rlimit files = {};
+    rlim_t needed = processes * 5 + 64;
+    if (::getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < needed) {
+        files.rlim_cur = std::min(needed, files.rlim_max);
+        ::setrlimit(RLIMIT_NOFILE, &files);
+    }
+    epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (epollFd == -1 || wakeFd == -1) {
+        LogErr("cannot create process loop: ", std::strerror(errno));
+        std::exit(1);
+    }
+    control(epollFd, EPOLL_CTL_ADD, wakeFd, EPOLLIN, &wakeFd);
+    if (cancelEventFd() >= 0) {
+        control(epollFd, EPOLL_CTL_ADD, cancelEventFd(), EPOLLIN, &cancelSeen);
+    }
+    thread = std::thread(&ProcessLoop::loop, this);
+}
+
+ProcessLoop::~ProcessLoop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    uint64_t one = 1;
+    while (::write(wakeFd, &one, sizeof(one)) == -1 && errno == EINTR) {}
+    thread.join();
+    ::close(wakeFd);
+    ::close(epollFd);
+}
+
+void ProcessLoop::add(ChildProcess & process, std::string_view input, Clock::time_point deadline, Done done) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        added.push_back(std::make_unique<Watched>(process, input, deadline, std::move(done)));
+    }
+    uint64_t one = 1;
+    while (::write(wakeFd, &one, sizeof(one)) == -1 && errno == EINTR) {}
+}
+
+void ProcessLoop::watch(std::unique_ptr<Watched> process) {
+    auto & child = process->process;
+    int & inFd = child.inFd();
+    process->out.eof = child.outFd() < 0;
+    process->err.eof = child.errFd() < 0;
+    for (int fd : {inFd, child.outFd(), child.errFd()}) {
+        if (fd >= 0) {
+            setNonBlocking(fd);
+        }
+    }
+    if (inFd >= 0) {
+        control(epollFd, EPOLL_CTL_ADD, inFd, EPOLLOUT, &process->sources[Watched::Source::IN]);
+    }
+    if (!process->out.eof) {
+        control(epollFd, EPOLL_CTL_ADD, child.outFd(), EPOLLIN, &process->sources[Watched::Source::OUT]);
+    }
+    if (!process->err.eof) {
+        control(epollFd, EPOLL_CTL_ADD, child.errFd(), EPOLLIN, &process->sources[Watched::Source::ERR]);
+    }
+    process->pidFd = pidfdOpen(child.pid());
+    if (process->pidFd >= 0) {
+        control(epollFd, EPOLL_CTL_ADD, process->pidFd, EPOLLIN, &process->sources[Watched::Source::PID]);
+    }
+    watched.push_back(std::move(process));
+    watched.back()->position = std::prev(watched.end());
+    checkDeadline(*watched.back(), Clock::now());
+}
+
+void ProcessLoop::checkDeadline(Watched & process, Clock::time_point now) {
+    if (!process.terminated && processesCancelled()) {
+        process.result.runStatus = RunStatus::CANCELLED;
+        process.deadline = now;
+    }
+    if (process.deadline > now) {
+        return;
+    }
+    if (process.result.runStatus == RunStatus::EXITED) {
+        process.result.runStatus = RunStatus::TIMEOUT;
+    }
+    int & inFd = process.process.inFd();
+    if (inFd >= 0) {
+        control(epollFd, EPOLL_CTL_DEL, inFd, 0, nullptr);
+        ::close(inFd);
+        inFd = -1;
+    }
+    ::killpg(process.process.pid(), process.terminated ? SIGKILL : SIGTERM);
+    process.deadline = process.terminated ? Clock::time_point::max() : now + terminateGrace;
+    process.terminated = true;
+}
+
+void ProcessLoop::finish(std::list<std::unique_ptr<Watched>>::iterator it) {
+    auto & process = **it;
+    auto & child = process.process;
+    int & inFd = child.inFd();
+    if (inFd >= 0) {
+        control(epollFd, EPOLL_CTL_DEL, inFd, 0, nullptr);
+        ::close(inFd);
+        inFd = -1;
+    }
+    for (int fd : {child.outFd(), child.errFd(), process.pidFd}) {
+        if (fd >= 0) {
+            // not registered any more after end of file
+            ::epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+    }
+    if (process.pidFd >= 0) {
+        ::close(process.pidFd);
+    }
+    process.finished = true;
+    // stdout before stderr, as by pumpProcess()
+    auto result = std::move(process.result);
+    result.msgs = std::move(process.out.msgs);
+    result.msgs.append(std::move(process.err.msgs));
+    process.done(std::move(result));
+}
+
+void ProcessLoop::loop() {
+    constexpr int maxEvents = 64;
+    epoll_event events[maxEvents];
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping && added.empty() && watched.empty()) {
+                return;
+            }
+        }
+        auto now = Clock::now();
+        auto nearest = Clock::time_point::max();
+        for (auto && process : watched) {
+            checkDeadline(*process, now);
+            nearest = std::min(nearest, process->deadline);
+        }
+        int timeoutMs = -1;
+        if (nearest != Clock::time_point::max()) {
+            timeoutMs = std::chrono::duration_cast<std::chrono::milliseconds>(nearest - now).count() + 1;
+        }
+        int count = ::epoll_wait(epollFd, events, maxEvents, timeoutMs);
+        if (count == -1) {
+            if (errno != EINTR) {
+                LogErr("epoll_wait failed: ", std::strerror(errno));
+            }
+            continue;
+        }
+        // finished processes are kept until all events of this round are handled
+        std::vector<std::unique_ptr<Watched>> done;
+        for (int i = 0; i < count; i++) {
+            void * data = events[i].data.ptr;
+            if (data == &wakeFd) {
+                uint64_t value;
+                while (::read(wakeFd, &value, sizeof(value)) == -1 && errno == EINTR) {}
+                std::vector<std::unique_ptr<Watched>> newProcesses;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    newProcesses.swap(added);
+                }
+                for (auto && process : newProcesses) {
+                    watch(std::move(process));
+                }
+                continue;
+            }
+            if (data == &cancelSeen) {
+                // stays readable, deadlines of all processes are checked every round
+                cancelSeen = true;
+                ::epoll_ctl(epollFd, EPOLL_CTL_DEL, cancelEventFd(), nullptr);
+                continue;
+            }
+            auto * source = static_cast<Watched::Source *>(data);
+            auto & process = *source->owner;
+            if (process.finished) {
+                continue;
+            }
+            auto & child = process.process;
+            switch (source->kind) {
+                case Watched::Source::IN: {
+                    int & inFd = child.inFd();
+                    ssize_t n = writeNoSigpipe(inFd, process.input.data() + process.written, process.input.size() - process.written);
+                    if (n > 0) {
+                        process.written += n;
+                    }
+                    if ((n == -1 && errno != EAGAIN && errno != EINTR) || process.written == process.input.size()) {
+                        control(epollFd, EPOLL_CTL_DEL, inFd, 0, nullptr);
+                        ::close(inFd);
+                        inFd = -1;
+                    }
+                    break;
+                }
+                case Watched::Source::OUT:
+                    process.out.read(child.outFd());
+                    if (process.out.eof) {
+                        control(epollFd, EPOLL_CTL_DEL, child.outFd(), 0, nullptr);
+                    }
+                    break;
+                case Watched::Source::ERR:
+                    process.err.read(child.errFd());
+                    if (process.err.eof) {
+                        control(epollFd, EPOLL_CTL_DEL, child.errFd(), 0, nullptr);
+                    }
+                    break;
+                case Watched::Source::PID:
+                    // descendants keeping pipes open do not delay the end
+                    while (!process.out.eof && process.out.read(child.outFd())) {}
+                    while (!process.err.eof && process.err.read(child.errFd())) {}
+                    process.out.finish();
+                    process.err.finish();
+                    process.exited = true;
+                    break;
+            }
+            // closed pipes do not mean exit, done() waits for the process
+            if (process.out.eof && process.err.eof && (process.exited || process.pidFd < 0)) {
+                auto it = process.position;
+                finish(it);
+                done.push_back(std::move(*it));
+                watched.erase(it);
+            }
+        }
+    }
+}
@@ -0,0 +1,74 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "process.h"
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/**
+ * I/O of all running child processes from one thread: stdin is fed, stdout and stderr drained
+ * and exit watched (pidfd) with epoll, deadlines and cancelAllProcesses() are handled as by pumpProcess().
+ * Threads do not wait for their children, count of threads does not grow with running processes.
+ */
+class ProcessLoop {
+public:
+    /**
+     * Called from the loop thread after exit of process and drain of its output, must not block.
+     * With pidfd the process has exited, its wait() returns at once.
+     * Task slots are returned there, work on the output is left to executor.
+     */
+    using Done = std::function<void(ProcessOutput &&)>;
+private:
+    struct Watched;
+    int epollFd = -1;
+    int wakeFd = -1;        ///< eventfd, new processes or stop
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Watched>> added;    ///< guarded by mutex, not yet in epoll
+    bool stopping = false;                          ///< guarded by mutex
+    std::list<std::unique_ptr<Watched>> watched;    ///< only in loop thread
+    bool cancelSeen = false;
+    std::thread thread;
+
+    void loop();
+    void watch(std::unique_ptr<Watched> process);
+    /// SIGTERM at deadline, SIGKILL after grace period
+    void checkDeadline(Watched & process, Clock::time_point now);
+    void finish(std::list<std::unique_ptr<Watched>>::iterator it);
+public:
+    /// @param processes expected running processes, limit of open files is raised for their pipes
+    explicit ProcessLoop(unsigned processes);
+    ~ProcessLoop();
+    ProcessLoop(const ProcessLoop &) = delete;
+    ProcessLoop & operator=(const ProcessLoop &) = delete;
+
+    /// pidfd is needed to watch exit without a waiting thread, Linux 5.3
+    static bool supported();
+    /**
+     * Watch started process until it exits, its pipes are switched to non blocking mode.
+     * @param input written to stdin pipe of process, kept valid by caller until done
+     * @param done called with output, wait() of process is left to it
+     */
+    void add(ChildProcess & process, std::string_view input, Clock::time_point deadline, Done done);
+};
@@ -30,6 +30,7 @@
 #include <cstdlib>      // for exit()
 #include <sys/types.h>  // for pid_t
 #include <sys/wait.h>   // for waitpid()
+#include <sys/resource.h>   // for wait4() rusage
 #include <sys/ioctl.h>  // for ioctl() and FIONREAD
 #if defined(__sun)
 # include <sys/filio.h> // for FIONREAD on Solaris 2.5
@@ -166,6 +167,14 @@ namespace redi
       int
       error() const;
 
+      /// Return the process id of the child, or 0 if there is none.
+      pid_t
+      pid() const { return ppid_; }
+
+      /// Return resources used by the child, valid after it was waited for.
+      const struct rusage &
+      rusage() const { return rusage_; }
+
     protected:
       /// Transfer characters to the pipe when character buffer overflows.
       int_type
@@ -260,6 +269,7 @@ namespace redi
       buf_read_src  rsrc_;
       int           status_;      // hold exit status of child process
       int           error_;       // hold errno if fork() or exec() fails
+      struct rusage rusage_ = {}; // resources used by waited child
     };
 
   /// Class template for common base class.
@@ -1570,7 +1580,7 @@ namespace redi
       if (is_open())
       {
         int exit_status;
-        switch(::waitpid(ppid_, &exit_status, nohang ? WNOHANG : 0))
+        switch(::wait4(ppid_, &exit_status, nohang ? WNOHANG : 0, &rusage_))
         {
           case 0 :
             // nohang was true and process has not exited
@@ -17,74 +17,140 @@
 */
 
 #include "taskBase.h"
-#include "pstream/pstream.h"
+#include "process.h"
+#include "worker.h"
+#include "processLoop.h"
 #include "log.h"
+#include "concurrency.h"
 
-std::pair<int, Messages> callProcess(const std::string & name, const std::vector<std::string> & args) {
-    redi::ipstream process(name, args, redi::pstreams::pstdout|redi::pstreams::pstderr);
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
 
-    std::string line;
-    Messages msg;
-    while (std::getline(process,line)) {
-        msg.push_back({MessageType::NORMAL, line});
+namespace {
+    /// process of one call, from start to wait
+    struct ProcessCall {
+        ChildProcessPtr process;
+        bool started = false;
+        std::string_view pipeInput;     ///< written to stdin pipe
+    };
+
+    void startProcess(ProcessCall & call, const std::string & name, const std::vector<std::string> & args, const Blob * input, const TaskCgroup * cgroup,
+            const std::vector<std::string> & environment, const std::string & workingDir) {
+        call.process = createChildProcess();
+        if (cgroup) {
+            call.process->setCgroup(cgroup->path());
+        }
+        call.process->setEnvironment(environment);
+        call.process->setWorkingDir(workingDir);
+        // child reads memfd directly, content is not copied through pipe
+        int stdinFd = input && call.process->supportsStdinFd() ? input->openForRead() : -1;
+        call.started = call.process->start(name, args, input != nullptr, stdinFd);
+        call.pipeInput = input && stdinFd < 0 ? input->view() : std::string_view();
+        if (stdinFd >= 0) {
+            ::close(stdinFd);
+        }
     }
-    process.clear();
-    process.err();
-    while (std::getline(process,line)) {
-        msg.push_back({MessageType::ERR, line});
+
+    ProcessResult finishProcess(ProcessCall & call, const std::string & name, ProcessOutput && output, const TaskCgroup * cgroup) {
+        ProcessResult result;
+        if (call.started) {
+            result.msgs = std::move(output.msgs);
+            result.runStatus = output.runStatus;
+        } else {
+            result.msgs.push_back({MessageType::ERR, "cannot execute \"" + name + "\": " + std::strerror(call.process->error())});
+        }
+        result.status = call.process->wait();
+        result.usage = call.process->usage();
+        if (cgroup && result.runStatus == RunStatus::EXITED && cgroup->oomKilled()) {
+            result.runStatus = RunStatus::OOM_KILLED;
+        }
+        return result;
+    }
+
+    ProcessResult runProcess(const std::string & name, const std::vector<std::string> & args, const Blob * input, double timeout, const TaskCgroup * cgroup,
+            const std::vector<std::string> & environment, const std::string & workingDir) {
+        RunStatus notStarted = notStartedStatus();
+        if (notStarted != RunStatus::EXITED) {
+            ProcessResult result;
+            result.runStatus = notStarted;
+            return result;
+        }
+        auto deadline = deadlineAfter(timeout);
+        ProcessCall call;
+        startProcess(call, name, args, input, cgroup, environment, workingDir);
+        ProcessOutput output;
+        if (call.started) {
+            output = pumpProcess(*call.process, call.pipeInput, deadline);
+        }
+        return finishProcess(call, name, std::move(output), cgroup);
     }
-    process.close();
-    return {process.rdbuf()->status(), msg};
 }
 
-std::pair<int, Messages> callProcess(const std::string & name, const std::vector<std::string> & args, const std::string & input) {
-    redi::pstream process(name, args, redi::pstreams::pstderr|redi::pstreams::pstdin|redi::pstreams::pstdout);
+ProcessResult callProcess(const std::string & name, const std::vector<std::string> & args, double timeout, const TaskCgroup * cgroup,
+        const std::vector<std::string> & environment, const std::string & workingDir) {
+    return runProcess(name, args, nullptr, timeout, cgroup, environment, workingDir);
+}
 
-    process << input << std::flush << redi::peof;
-    enum streamEnd {
-        STDERR = 1,
-        STDOUT = 2,
-        ALL = STDERR | STDOUT
-    };
-    int end = 0;
-    constexpr int size = 1024;
-    std::string buf;
-    buf.resize(size);
-    std::string unfinishedOut;
-    std::string unfinishedErr;
-    Messages msg;
-    auto reader = [&buf, &msg](auto & stream, MessageType msgType, std::string & unfinished){
-        int n;
-        while ((n = stream.readsome(buf.data(), size))) {
-            buf.resize(n);
-            buf = unfinished + buf;
-            int beginPos = 0;
-            auto newLinePos = buf.find('\n', beginPos);
-            while (newLinePos != std::string::npos) {
-                msg.push_back({msgType, buf.substr(beginPos, newLinePos - beginPos)});
-                beginPos = newLinePos + 1;
-                newLinePos = buf.find('\n', beginPos);
-            }
-            unfinished = buf.substr(beginPos, newLinePos - beginPos);
-            buf.resize(size);
-        };
+ProcessResult callProcess(const std::string & name, const std::vector<std::string> & args, const Blob & input, double timeout, const TaskCgroup * cgroup,
+        const std::vector<std::string> & environment, const std::string & workingDir) {
+    return runProcess(name, args, &input, timeout, cgroup, environment, workingDir);
+}
+
+std::vector<std::string> slotsEnvironment(unsigned slots) {
+    if (!slots) {
+        return {};
+    }
+    // Export what is actually reserved, see TaskPhases slots in main.
+    return {"GIT_VERIFY_SLOTS=" + std::to_string(std::clamp(slots, 1u, concurrency()))};
+}
+
+TaskPstream::~TaskPstream() {
+    for (auto && path : tempFiles) {
+        ::unlink(path.c_str());
+    }
+}
+
+bool TaskPstream::start(ProcessLoop & loop, std::function<void(Messages)> done) {
+    LogDev("useStdIn", useStdIn ? 1 : 0);
+    RunStatus notStarted = notStartedStatus();
+    if (notStarted != RunStatus::EXITED) {
+        status = 1;
+        runStatus = notStarted;
+        done({});
+        return true;
+    }
+    if (useStdIn && contentSource) {
+        fileContent = contentSource();
+    }
+    auto deadline = deadlineAfter(timeout);
+    startedCgroup = createTaskCgroup(descr.taskTypeName, cgroupLimits);
+    auto call = std::make_shared<ProcessCall>();
+    startProcess(*call, programName, args, useStdIn ? fileContent.get() : nullptr, startedCgroup.get(), slotsEnvironment(slots), workingDir);
+    auto finish = [this, call, done](ProcessOutput && output) {
+        auto result = finishProcess(*call, programName, std::move(output), startedCgroup.get());
+        fileContent.reset();
+        status = result.status;
+        runStatus = result.runStatus;
+        usage = result.usage;
+        done(std::move(result.msgs));
     };
-    
-    while (end != ALL) {
-        if (!process.out().eof()) {
-            reader(process.out(), MessageType::NORMAL, unfinishedOut);
-        } else {
-            end |= STDOUT;
-            msg.push_back({MessageType::NORMAL, unfinishedOut});
-        }
-        if (!process.err().eof()) {
-            reader(process.err(), MessageType::ERR, unfinishedErr);
-        } else {
-            end |= STDERR;
-            msg.push_back({MessageType::ERR, unfinishedErr});
-        }
+    if (call->started) {
+        loop.add(*call->process, call->pipeInput, deadline, finish);
+    } else {
+        finish(ProcessOutput());
     }
+    return true;
+}
 
-    process.close();
-    return std::make_pair(process.rdbuf()->status(), msg);
+Messages TaskWorker::run() {
+    if (contentSource) {
+        fileContent = contentSource();
+    }
+    auto result = pool->request(descr.fileName, fileContent->view(), timeout);
+    fileContent.reset();
+    status = result.status;
+    runStatus = result.runStatus;
+    usage = result.usage;
+    return std::move(result.msgs);
 }
@@ -18,24 +18,76 @@
 
 #pragma once
 #include "messages.h"
+#include "blob.h"
+#include "process.h"
+#include "cgroup.h"
 #include "log.h"
 
+#include <functional>
+
 class Task;
+class WorkerPool;
+class ProcessLoop;
 
 using TaskPtr = std::unique_ptr<Task>;
 
 struct TaskRunDescription {
     std::string taskTypeName;
     std::string fileName;
+    size_t inputSize = 0;   ///< bytes of checked content, for duration estimates
 };
 
 class Task {
 protected:
     TaskRunDescription descr;
+    RunStatus runStatus = RunStatus::EXITED;
+    ResourceUsage usage;
+    double timeout = 0;
+    CgroupLimits cgroupLimits;
+    unsigned slots = 0;
+    std::string workingDir;
 public:
     Task() = default;
+    virtual ~Task() = default;
     virtual Messages run() = 0;
+    /**
+     * Start task with its process watched by loop, instead of run() blocking the calling thread.
+     * @param done called with output from thread of loop, must not block
+     * @return false if task type supports only run()
+     */
+    virtual bool start(ProcessLoop & loop, std::function<void(Messages)> done) {
+        (void) loop;
+        (void) done;
+        return false;
+    }
+    /// after done() of start(), outside of the loop thread: removal of task cgroup retries with sleeps
+    virtual void cleanup() {}
     virtual int getStatus() = 0;
+    RunStatus getRunStatus() {
+        return runStatus;
+    }
+    const ResourceUsage & getUsage() {
+        return usage;
+    }
+    /// @param timeout seconds, 0 - no limit
+    void setTimeout(double timeout) {
+        this->timeout = timeout;
+    }
+    /// applied when cgroups are enabled
+    void setCgroupLimits(const CgroupLimits & cgroupLimits) {
+        this->cgroupLimits = cgroupLimits;
+    }
+    /// parallel task slots reserved while task runs, exported to its process as GIT_VERIFY_SLOTS, 0 - one slot, not exported
+    void setSlots(unsigned slots) {
+        this->slots = slots;
+    }
+    unsigned getSlots() {
+        return slots;
+    }
+    /// directory of checked out revision the process runs in, empty - current directory
+    void setWorkingDir(const std::string & dir) {
+        workingDir = dir;
+    }
     TaskRunDescription getDescr() {
         return this->descr;
     }
@@ -51,39 +103,103 @@ public:
     virtual int getStatus() override { return 0; }
 };
 
-std::pair<int, Messages> callProcess(const std::string & name, const std::vector<std::string> & args);
-std::pair<int, Messages> callProcess(const std::string & name, const std::vector<std::string> & args, const std::string & input);
+/// @param cgroup joined by process, nullptr for none
+/// @param environment "NAME=value" added to environment of process
+/// @param workingDir directory of process, empty - current directory
+ProcessResult callProcess(const std::string & name, const std::vector<std::string> & args, double timeout, const TaskCgroup * cgroup = nullptr,
+        const std::vector<std::string> & environment = {}, const std::string & workingDir = {});
+ProcessResult callProcess(const std::string & name, const std::vector<std::string> & args, const Blob & input, double timeout, const TaskCgroup * cgroup = nullptr,
+        const std::vector<std::string> & environment = {}, const std::string & workingDir = {});
+
+/// environment of task process with slots, see Task::setSlots()
+std::vector<std::string> slotsEnvironment(unsigned slots);
 
 class TaskPstream : public Task {
     std::string programName;
     std::vector<std::string> args;
-    std::string fileContent;
+    BlobSource contentSource;
+    BlobPtr fileContent;
+    std::vector<std::string> tempFiles;
+    TaskCgroupPtr startedCgroup;    ///< of process watched by loop, removed by cleanup()
     int status;
     bool useStdIn = true;
 public:
     TaskPstream() = default;
+    ~TaskPstream() override;
 
     void setProgram(const std::string & programName, const std::vector<std::string> & args) {
         this->programName = programName;
         this->args = args;
     }
 
-    void setFileContent (const std::string & fileContent) {
+    /// released after run, content is freed with the last task of the file
+    void setFileContent (const BlobPtr & fileContent) {
         this->fileContent = fileContent;
     }
+
+    /// content read when task starts, queued tasks keep no memfd open
+    void setContentSource(const BlobSource & contentSource) {
+        this->contentSource = contentSource;
+    }
     
     void setUseStdIn(bool useStdIn) {
         this->useStdIn = useStdIn;
     }
 
+    /// file removed with task
+    void addTempFile(const std::string & path) {
+        tempFiles.push_back(path);
+    }
+
     int getStatus() override {
         return status;
     }
     
+    bool start(ProcessLoop & loop, std::function<void(Messages)> done) override;
+    void cleanup() override {
+        startedCgroup.reset();
+    }
+
     virtual Messages run() override {
         LogDev("useStdIn", useStdIn ? 1 : 0);
-        auto result = useStdIn ? callProcess(programName, args, fileContent ) : callProcess(programName, args);
-        status = result.first;
-        return result.second;
+        auto cgroup = createTaskCgroup(descr.taskTypeName, cgroupLimits);
+        auto environment = slotsEnvironment(slots);
+        if (useStdIn && contentSource) {
+            fileContent = contentSource();
+        }
+        auto result = useStdIn
+            ? callProcess(programName, args, *fileContent, timeout, cgroup.get(), environment, workingDir)
+            : callProcess(programName, args, timeout, cgroup.get(), environment, workingDir);
+        fileContent.reset();
+        status = result.status;
+        runStatus = result.runStatus;
+        usage = result.usage;
+        return std::move(result.msgs);
+    }
+};
+
+/// file checked by persistent worker process, see WorkerPool
+class TaskWorker : public Task {
+    std::shared_ptr<WorkerPool> pool;
+    BlobSource contentSource;
+    BlobPtr fileContent;
+    int status;
+public:
+    explicit TaskWorker(const std::shared_ptr<WorkerPool> & pool) : pool(pool) {}
+
+    /// released after run, content is freed with the last task of the file
+    void setFileContent (const BlobPtr & fileContent) {
+        this->fileContent = fileContent;
     }
+
+    /// content read when task starts, queued tasks keep no memfd open
+    void setContentSource(const BlobSource & contentSource) {
+        this->contentSource = contentSource;
+    }
+
+    int getStatus() override {
+        return status;
+    }
+
+    virtual Messages run() override;
 };
@@ -19,30 +19,321 @@
 #include "taskCreator.h"
 
 #include "gitWrapper.h"
+#include "worker.h"
+#include "concurrency.h"
 
 #include <filesystem>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <thread>
+#include <utility>
+#include <cstring>
+#include <unistd.h>
+
+extern char ** environ;
 
 namespace {
-    auto prepareArgs(const TaskType::Process & process, const std::string & fileName) {
+    auto prepareArgs(const TaskType::Process & process, const std::vector<std::string> & fileNames) {
         auto args = std::vector<std::string>();
         args.push_back(process.executable);     // first param is always process name
-        std::transform(process.params.begin(), process.params.end(), std::back_inserter(args),
-            [&fileName](const std::variant<std::string, TaskType::Process::Special> & param) -> auto {
-                if (param.index() == 1) {
-                    return fileName;    // TaskType::Process::Special::FILENAME
-                } else {
-                    return std::get<std::string>(param);
-                }
+        for (auto && param : process.params) {
+            if (param.index() == 0) {
+                args.push_back(std::get<std::string>(param));
+            } else if (std::get<TaskType::Process::Special>(param) == TaskType::Process::Special::FILENAMES) {
+                args.insert(args.end(), fileNames.begin(), fileNames.end());
+            } else {
+                args.push_back(fileNames.size() ? fileNames.front() : std::string());
             }
-        );
+        }
         return args;
     };
-    
+
+    auto prepareArgs(const TaskType::Process & process, const std::string & fileName) {
+        return prepareArgs(process, std::vector<std::string>{fileName});
+    };
+
+    /// bytes of exec() argument space used by argument
+    size_t argSize(const std::string & arg) {
+        return arg.size() + 1 + sizeof(char*);
+    }
+
+    size_t argsSize(const std::vector<std::string> & args) {
+        size_t size = 0;
+        for (auto && arg : args) {
+            size += argSize(arg);
+        }
+        return size;
+    }
+
+    /// ARG_MAX without space used by environment
+    size_t argsLimit() {
+        size_t limit = sysconf(_SC_ARG_MAX);
+        for (char ** env = environ; *env; env++) {
+            limit -= argSize(*env);
+        }
+        constexpr size_t margin = 4096;
+        return limit > margin ? limit - margin : 0;
+    }
+
+    /**
+     * Batch count is a multiple of thread count, so every thread gets similar amount of files.
+     * Batch is split when arguments do not fit into ARG_MAX and response file is not configured.
+     */
+    std::vector<std::vector<std::string>> splitToBatches(const TaskType::Process & process, const std::vector<std::string> & fileNames, size_t threadNum) {
+        std::vector<std::vector<std::string>> batches;
+        size_t fileNum = fileNames.size();
+        if (fileNum == 0) {
+            return batches;
+        }
+        threadNum = std::max<size_t>(threadNum, 1);
+        size_t maxBatch = process.batchSize ? process.batchSize : fileNum;
+        size_t batchNum = std::max((fileNum + maxBatch - 1) / maxBatch, std::min(threadNum, fileNum));
+        batchNum = std::min(fileNum, (batchNum + threadNum - 1) / threadNum * threadNum);
+        const size_t limit = argsLimit();
+        const size_t baseSize = argsSize(prepareArgs(process, std::vector<std::string>()));
+        size_t begin = 0;
+        for (size_t i = 0; i < batchNum; i++) {
+            size_t end = begin + fileNum / batchNum + (i < fileNum % batchNum ? 1 : 0);
+            std::vector<std::string> batch;
+            size_t size = baseSize;
+            for (size_t fileId = begin; fileId < end; fileId++) {
+                size_t fileArgSize = argSize(fileNames[fileId]);
+                if (process.responseFile.empty() && batch.size() && size + fileArgSize > limit) {
+                    batches.push_back(std::move(batch));
+                    batch.clear();
+                    size = baseSize;
+                }
+                batch.push_back(fileNames[fileId]);
+                size += fileArgSize;
+            }
+            batches.push_back(std::move(batch));
+            begin = end;
+        }
+        return batches;
+    }
+
+    /// file names, one per line, quoted when needed
+    std::string writeResponseFile(const std::vector<std::string> & fileNames) {
+        auto path = (std::filesystem::temp_directory_path() / "git-verify-XXXXXX").string();
+        int fd = mkstemp(path.data());
+        if (fd == -1) {
+            LogErr("cannot create response file: ", std::strerror(errno));
+            std::exit(1);
+        }
+        std::string content;
+        for (auto && fileName : fileNames) {
+            if (fileName.find_first_of(" \t\n\"'\\") == std::string::npos) {
+                content += fileName;
+            } else {
+                content += '"';
+                for (char c : fileName) {
+                    if (c == '"' || c == '\\') {
+                        content += '\\';
+                    }
+                    content += c;
+                }
+                content += '"';
+            }
+            content += '\n';
+        }
+        size_t written = 0;
+        while (written < content.size()) {
+            ssize_t n = ::write(fd, content.data() + written, content.size() - written);
+            if (n <= 0) {
+                LogErr("cannot write response file: ", std::strerror(errno));
+                std::exit(1);
+            }
+            written += n;
+        }
+        ::close(fd);
+        return path;
+    }
+
+    Processing * createProcessing(const TaskType::Process & process) {
+        switch (process.testType) {
+            case TestType::RETURN:
+                return new ProcessingReturnValue();
+            case TestType::MATCH_FAIL: [[fallthrough]];
+            case TestType::MATCH_SUCCESS:
+                return new ProcessingMatch(
+                    process.testType == TestType::MATCH_SUCCESS,
+                    process.testType == TestType::MATCH_SUCCESS ? process.matchForSuccess : process.matchForFail
+                );
+            case TestType::DIFF: [[fallthrough]];
+            case TestType::DIFF_WITH_CHECKOUT:
+                break;
+        }
+        return nullptr;
+    }
+
+    /// default: only content sent on stdin is read, so tool runs the same with any revision checked out
+    bool needsWorktree(const TaskType & taskType) {
+        using TargetType = TaskType::TargetType;
+        if (taskType.targetType == TargetType::BUILD) {
+            return true;
+        }
+        if (taskType.needsWorktree) {
+            return *taskType.needsWorktree;
+        }
+        bool stdinTarget = taskType.targetType == TargetType::FILE
+            || taskType.targetType == TargetType::ADDED_TEXT
+            || taskType.targetType == TargetType::COMMIT_TEXT;
+        const auto & process = taskType.process;
+        return !stdinTarget || !process.useStdin || process.isBatch() || process.testType == TestType::DIFF_WITH_CHECKOUT;
+    }
+
+    /// enabled task types every enabled type depends on, exits on unknown type or cycle
+    std::map<std::string, std::vector<std::string>> typeDependencies(const TaskTypesMap & taskTypes) {
+        std::map<std::string, std::vector<std::string>> result;
+        const std::string * previousBuild = nullptr;
+        for (auto && item : taskTypes) {
+            const auto & taskType = item.second;
+            if (!taskType.enabled) {
+                continue;
+            }
+            auto & dependencies = result[item.first];
+            bool isBuild = taskType.targetType == TaskType::TargetType::BUILD;
+            const std::string * buildBefore = previousBuild;
+            if (isBuild) {
+                previousBuild = &item.first;
+            }
+            if (!taskType.dependsOn) {
+                if (isBuild) {
+                    // builds run one after another in name order, as before dependsOn existed
+                    if (buildBefore) {
+                        dependencies.push_back(*buildBefore);
+                    }
+                    continue;
+                }
+                if (!needsWorktree(taskType)) {
+                    continue;
+                }
+                for (auto && other : taskTypes) {
+                    if (other.second.enabled && other.second.targetType == TaskType::TargetType::BUILD) {
+                        dependencies.push_back(other.first);
+                    }
+                }
+                continue;
+            }
+            for (auto && dependency : *taskType.dependsOn) {
+                auto dependencyIt = taskTypes.find(dependency);
+                if (dependencyIt == taskTypes.end()) {
+                    LogErr("\"", item.first, "\" depends on unknown task \"", dependency, "\"");
+                    std::exit(1);
+                }
+                if (dependencyIt->second.enabled) {
+                    dependencies.push_back(dependency);
+                }
+            }
+        }
+        enum class Mark {
+            NONE,
+            VISITING,
+            DONE,
+        };
+        std::map<std::string, Mark> marks;
+        std::vector<std::string> path;
+        std::function<void(const std::string &)> visit = [&](const std::string & name) {
+            auto & mark = marks[name];
+            if (mark == Mark::DONE) {
+                return;
+            }
+            if (mark == Mark::VISITING) {
+                std::string cycle;
+                for (auto it = std::find(path.begin(), path.end(), name); it != path.end(); ++it) {
+                    cycle += *it + " -> ";
+                }
+                LogErr("dependsOn cycle: ", cycle, name);
+                std::exit(1);
+            }
+            mark = Mark::VISITING;
+            path.push_back(name);
+            for (auto && dependency : result[name]) {
+                visit(dependency);
+            }
+            path.pop_back();
+            mark = Mark::DONE;
+        };
+        for (auto && item : result) {
+            visit(item.first);
+        }
+        return result;
+    }
+
+    /// enabled task types not needing worktree, nor any of their dependencies
+    std::set<std::string> typesWithoutWorktree(const TaskTypesMap & taskTypes, const std::map<std::string, std::vector<std::string>> & typeDependency) {
+        std::map<std::string, bool> known;
+        std::function<bool(const std::string &)> withoutWorktree = [&](const std::string & name) {
+            auto knownIt = known.find(name);
+            if (knownIt != known.end()) {
+                return knownIt->second;
+            }
+            bool result = !needsWorktree(taskTypes.at(name));
+            for (auto && dependency : typeDependency.at(name)) {
+                result = withoutWorktree(dependency) && result;
+            }
+            known[name] = result;
+            return result;
+        };
+        std::set<std::string> result;
+        for (auto && item : typeDependency) {
+            if (withoutWorktree(item.first)) {
+                result.insert(item.first);
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Content of files read when the first task of a file starts and shared by tasks of the file running meanwhile.
+     * Queued tasks keep only the key, memfd of content is open while a task of the file runs.
+     */
+    class LazyBlobs {
+        std::function<std::string(const std::string &)> read;
+        std::mutex mutex;
+        std::vector<std::string> keys;
+        std::vector<std::weak_ptr<const Blob>> blobs;
+    public:
+        /// @param read content for key, called from threads of running tasks
+        explicit LazyBlobs(std::function<std::string(const std::string &)> read) : read(std::move(read)) {}
+
+        /// @return index for get()
+        size_t add(std::string key) {
+            std::lock_guard<std::mutex> lock(mutex);
+            keys.push_back(std::move(key));
+            blobs.emplace_back();
+            return keys.size() - 1;
+        }
+
+        BlobPtr get(size_t index) {
+            std::string key;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (auto blob = blobs[index].lock()) {
+                    return blob;
+                }
+                key = keys[index];
+            }
+            // other files are read meanwhile
+            BlobPtr blob = makeBlob(read(key));
+            std::lock_guard<std::mutex> lock(mutex);
+            if (auto other = blobs[index].lock()) {
+                return other;
+            }
+            blobs[index] = blob;
+            return blob;
+        }
+    };
+
     bool testFile(const TaskType::File &taskFileConfig, const std::filesystem::path & filePath) {
         namespace fs = std::filesystem;
         for (auto && exceptionTest : taskFileConfig.exceptions) {
-            auto exceptionBegin = fs::relative(filePath, exceptionTest).begin();
-            if ((*exceptionBegin) != "..") {
+            auto relative = fs::relative(filePath, exceptionTest);
+            if (*relative.begin() != "..") {
                 return false;
             }
         }
@@ -55,8 +346,8 @@ namespace {
                     return true;
                 }
             } else if (fs::is_directory(fileTest)) {
-                auto beginOfRelative = fs::relative(filePath, fileTest).begin();
-                if ((*beginOfRelative) != "..") {
+                auto relative = fs::relative(filePath, fileTest);
+                if (*relative.begin() != "..") {
                     return true;
                 }
             }
@@ -65,155 +356,332 @@ namespace {
     };
 }
 
-TaskPhases TasksCreator::create() {
-    ChangesData changesData = git->getChangedFiles(config.localSha, config.remoteSha);
+TaskPhases TasksCreator::create(const TaskStream & stream) {
+    // workers start up while changes are computed
+    std::map<std::string, std::shared_ptr<WorkerPool>> workerPools;
+    for (auto && taskType : taskTypes) {
+        if (taskType.second.enabled && taskType.second.type == TaskType::Type::WORKER) {
+            const auto & process = taskType.second.process;
+            unsigned size = process.workers ? process.workers : concurrency();
+            auto pool = std::make_shared<WorkerPool>(process.executable, prepareArgs(process, std::string()), size);
+            pool->setCgroupLimits(taskType.first, process.cgroupLimits);
+            pool->setEnvironment(slotsEnvironment(process.slots));
+            pool->start();
+            workerPools[taskType.first] = pool;
+        }
+    }
+    RevisionRange range = git->resolveRange(config.localSha, config.remoteSha);
+    ChangesData changesData;
     TaskPhases phases;
-    std::map<std::string, std::string> addedLinesCache;
-    auto getAddedLines = [this, &addedLinesCache](std::string fileName) {
-        if (!addedLinesCache.count(fileName)) {
-            addedLinesCache[fileName] = git->getAddedLines(config.localSha, config.remoteSha, fileName);
+    // all files from one diff on first use, blob of file is made when its first task starts
+    auto addedLines = std::make_shared<std::map<std::string, AddedLines>>();
+    auto addedLinesBlobs = std::make_shared<LazyBlobs>([addedLines](const std::string & fileName) {
+        auto it = addedLines->find(fileName);
+        return it != addedLines->end() ? it->second.text : std::string();
+    });
+    bool addedLinesRead = false;
+    std::map<std::string, size_t> addedLinesIndexes;
+    auto getAddedLines = [this, &range, &addedLines, &addedLinesRead, &addedLinesBlobs, &addedLinesIndexes](const std::string & fileName) {
+        if (!addedLinesRead) {
+            *addedLines = git->getAddedLines(range);
+            addedLinesRead = true;
+        }
+        auto [it, added] = addedLinesIndexes.emplace(fileName, 0);
+        if (added) {
+            it->second = addedLinesBlobs->add(fileName);
         }
-        return addedLinesCache[fileName];
+        return BlobSource([addedLinesBlobs, index = it->second]{ return addedLinesBlobs->get(index); });
+    };
+    auto addedLinesSize = [&addedLines](const std::string & fileName) {
+        auto it = addedLines->find(fileName);
+        return it != addedLines->end() ? it->second.text.size() : 0;
     };
     auto changedByExt = std::map<std::string, std::vector<int>>();
-    {
-        int i = 0;
-        for (auto && fileName : changesData.newFiles) {
-            auto path = std::filesystem::path(fileName);
+    // content is read when first task of the file starts, freed with the last running task
+    auto readBlob = [this](const std::string & id) {
+        return git->readBlob(id);
+    };
+    auto newBlobs = std::make_shared<LazyBlobs>(readBlob);
+    auto oldBlobs = std::make_shared<LazyBlobs>(readBlob);
+    /// @param byExt file is matched by its extension and by "match all", otherwise it is registered by caller
+    auto addFile = [&changedByExt, &changesData, &newBlobs, &oldBlobs](ChangedFile && file, bool byExt = true) {
+        int fileId = changesData.newFiles.size();
+        auto path = std::filesystem::path(file.name);
+        if (byExt) {
             if(path.has_extension()) {
                 auto ext = lastPart(path.string(), '.');
-                changedByExt[ext].push_back(i);
+                changedByExt[ext].push_back(fileId);
             }
-            changedByExt[""].push_back(i);
-            i++;
+            changedByExt[""].push_back(fileId);
         }
-    }
-    changedByExt["___any_change___"].push_back(changesData.newFileContent.size());
-    changesData.newFileContent.push_back("non empty content");
-    changesData.newFiles.push_back("___any_change___");
-    changesData.oldFileContent.push_back("non empty content");
+        newBlobs->add(file.newId);
+        oldBlobs->add(file.oldId);
+        changesData.newFiles.push_back(std::move(file.name));
+        changesData.newIds.push_back(std::move(file.newId));
+        changesData.oldIds.push_back(std::move(file.oldId));
+        changesData.newModes.push_back(file.newMode);
+        changesData.newSizes.push_back(file.newSize);
+        changesData.oldSizes.push_back(file.oldSize);
+        return fileId;
+    };
+    auto newBlob = [&newBlobs](int fileId) {
+        return BlobSource([newBlobs, fileId]{ return newBlobs->get(fileId); });
+    };
+    auto oldBlob = [&oldBlobs](int fileId) {
+        return BlobSource([oldBlobs, fileId]{ return oldBlobs->get(fileId); });
+    };
+    auto newSize = [&changesData](int fileId) {
+        return changesData.newSizes[fileId];
+    };
+    auto oldSize = [&changesData](int fileId) {
+        return changesData.oldSizes[fileId];
+    };
+    auto existInOld = [&oldSize](int fileId) {
+        return oldSize(fileId) != 0;
+    };
 
-    auto forEachFile = [&changedByExt, &changesData, &phases, &getAddedLines](const TaskType & taskType) -> void{
+    auto fileMatches = [&changesData](const TaskType & taskType, int fileId) {
+        auto path = std::filesystem::path(changesData.newFiles[fileId]);
+        const auto & exts = taskType.file.value().ext;
+        bool extMatches = std::find(exts.begin(), exts.end(), "") != exts.end()
+            || (path.has_extension() && std::find(exts.begin(), exts.end(), lastPart(path.string(), '.')) != exts.end());
+        return extMatches && testFile(taskType.file.value(), path);
+    };
+
+    auto matchingFiles = [&changedByExt, &changesData](const TaskType & taskType) {
         namespace fs = std::filesystem;
+        std::vector<int> result;
         for (auto && ext : taskType.file.value().ext) {
             if (!changedByExt.count(ext)) {
                 continue;
             }
             for (auto && fileId : changedByExt[ext]){
-                auto fileName = changesData.newFiles[fileId];
-                auto filePath = fs::path(fileName);
-                if (!testFile(taskType.file.value(), filePath)) {
-                    continue;
+                if (testFile(taskType.file.value(), fs::path(changesData.newFiles[fileId]))) {
+                    result.push_back(fileId);
                 }
-                const auto & process = taskType.process;
-                auto task = new TaskPstream();
-                Processing * processing = nullptr;
-                auto args = prepareArgs(process, fileName);
-
-                task->setProgram(process.executable, args);
-                task->setDesrc(TaskRunDescription{
-                    .taskTypeName = taskType.name,
-                    .fileName = fileName,
-                });
-                task->setUseStdIn(process.useStdin);
-                if (taskType.targetType == TaskType::TargetType::ADDED_TEXT) {
-                    task->setFileContent(getAddedLines(fileName));
+            }
+        }
+        return result;
+    };
+
+    auto forFile = [&changesData, &phases, &getAddedLines, &addedLinesSize, &workerPools, &newBlob, &oldBlob, &newSize, &oldSize, &existInOld](const TaskType & taskType, int fileId) -> void{
+        auto fileName = changesData.newFiles[fileId];
+        const auto & process = taskType.process;
+        Processing * processing = nullptr;
+        auto args = prepareArgs(process, fileName);
+        auto createTask = [&taskType, &process, &args, &workerPools](const BlobSource & fileContent) -> Task * {
+            if (taskType.type == TaskType::Type::WORKER) {
+                auto task = new TaskWorker(workerPools.at(taskType.name));
+                task->setContentSource(fileContent);
+                task->setTimeout(process.timeout);
+                task->setSlots(process.slots);
+                return task;
+            }
+            auto task = new TaskPstream();
+            task->setProgram(process.executable, args);
+            task->setUseStdIn(process.useStdin);
+            task->setContentSource(fileContent);
+            task->setTimeout(process.timeout);
+            task->setSlots(process.slots);
+            task->setCgroupLimits(process.cgroupLimits);
+            return task;
+        };
+
+        // content of file read by tool from worktree is not read from git
+        bool readsContent = taskType.type == TaskType::Type::WORKER || process.useStdin;
+        bool addedText = taskType.targetType == TaskType::TargetType::ADDED_TEXT;
+        BlobSource content;
+        if (readsContent) {
+            content = addedText ? getAddedLines(fileName) : newBlob(fileId);
+        }
+        Task * task = createTask(content);
+        task->setDesrc(TaskRunDescription{
+            .taskTypeName = taskType.name,
+            .fileName = fileName,
+            .inputSize = readsContent && addedText ? addedLinesSize(fileName) : newSize(fileId),
+        });
+
+        switch (process.testType) {
+            case TestType::DIFF_WITH_CHECKOUT: [[fallthrough]];
+            case TestType::DIFF:
+                if (!process.useStdin && process.testType == TestType::DIFF) {
+                    LogErr("TestType DIFF require useStdin");
+                    std::exit(1);
                 } else {
-                    task->setFileContent(changesData.newFileContent[fileId]);
+                    auto sharedDiffState = std::make_shared<SharedDiffState>();
+                    processing = new ProcessingDiff(
+                        ProcessingDiff::DiffPart::B, process.logDiffFilterRegex, sharedDiffState
+                    );
+                    Task * task2 = nullptr;
+                    if (existInOld(fileId)) {
+                        task2 = createTask(readsContent ? oldBlob(fileId) : BlobSource());
+                        task2->setDesrc(TaskRunDescription{
+                            .taskTypeName = taskType.name,
+                            .fileName = fileName,
+                            .inputSize = oldSize(fileId),
+                        });
+                    } else {
+                        auto taskNull = new TaskNull();
+                        taskNull->setDesrc(TaskRunDescription{
+                            .taskTypeName = "empty_file",
+                            .fileName = fileName,
+                        });
+                        task2 = taskNull;
+                    }
+                    if (process.testType == TestType::DIFF_WITH_CHECKOUT) {
+                        phases.forOld.push_back(TaskPtr(task2));
+                        phases.processingForOld.push_back(std::unique_ptr<Processing>(new ProcessingDiff(
+                            ProcessingDiff::DiffPart::A, process.logDiffFilterRegex, sharedDiffState
+                        )));
+                    } else {
+                        phases.forNew.push_back(TaskPtr(task2));
+                        phases.processingForNew.push_back(std::unique_ptr<Processing>(new ProcessingDiff(
+                            ProcessingDiff::DiffPart::A, process.logDiffFilterRegex, sharedDiffState
+                        )));
+                    }
                 }
+                break;
+            case TestType::RETURN: [[fallthrough]];
+            case TestType::MATCH_FAIL: [[fallthrough]];
+            case TestType::MATCH_SUCCESS:
+                processing = createProcessing(process);
+            break;
+        }
+        phases.forNew.push_back(TaskPtr(task));
+        phases.processingForNew.push_back(std::unique_ptr<Processing>(processing));
+    };
 
-                switch (process.testType) {
-                    case TestType::DIFF_WITH_CHECKOUT: [[fallthrough]];
-                    case TestType::DIFF:
-                        if (!process.useStdin && process.testType == TestType::DIFF) {
-                            LogErr("TestType DIFF require useStdin");
-                            std::exit(1);
-                        } else {
-                            auto sharedDiffState = std::make_shared<SharedDiffState>();
-                            processing = new ProcessingDiff(
-                                ProcessingDiff::DiffPart::B, process.logDiffFilterRegex, sharedDiffState
-                            );
-                            Task * task2 = nullptr;
-                            if (changesData.oldFileContent[fileId].size()) {
-                                auto taskOldData = new TaskPstream();
-                                taskOldData->setProgram(process.executable, args);
-                                taskOldData->setDesrc(TaskRunDescription{
-                                    .taskTypeName = taskType.name,
-                                    .fileName = fileName,
-                                });
-                                taskOldData->setFileContent(changesData.oldFileContent[fileId]);
-                                taskOldData->setUseStdIn(process.useStdin);
-                                task2 = taskOldData;
-                            } else {
-                                auto taskNull = new TaskNull();
-                                taskNull->setDesrc(TaskRunDescription{
-                                    .taskTypeName = "empty_file",
-                                    .fileName = fileName,
-                                });
-                                task2 = taskNull;
-                            }
-                            if (process.testType == TestType::DIFF_WITH_CHECKOUT) {
-                                phases.forOld.push_back(TaskPtr(task2));
-                                phases.processingForOld.push_back(std::unique_ptr<Processing>(new ProcessingDiff(
-                                    ProcessingDiff::DiffPart::A, process.logDiffFilterRegex, sharedDiffState
-                                )));
-                            } else {
-                                phases.forNew.push_back(TaskPtr(task2));
-                                phases.processingForNew.push_back(std::unique_ptr<Processing>(new ProcessingDiff(
-                                    ProcessingDiff::DiffPart::A, process.logDiffFilterRegex, sharedDiffState
-                                )));
-                            }
-                        }
-                        break;
-                    case TestType::RETURN:
-                        processing = new ProcessingReturnValue();
-                        break;
-                    case TestType::MATCH_FAIL: [[fallthrough]];
-                    case TestType::MATCH_SUCCESS:
-                        processing = new ProcessingMatch(
-                            process.testType == TestType::MATCH_SUCCESS,
-                            process.testType == TestType::MATCH_SUCCESS ? process.matchForSuccess : process.matchForFail
-                        );
-                    break;
+    auto forEachFile = [&matchingFiles, &forFile](const TaskType & taskType) -> void {
+        for (auto && fileId : matchingFiles(taskType)) {
+            forFile(taskType, fileId);
+        }
+    };
+
+    auto forBatch = [&matchingFiles, &changesData, &phases, &existInOld, &newSize, &oldSize](const TaskType & taskType) -> void {
+        const auto & process = taskType.process;
+        std::vector<std::string> fileNames;
+        std::vector<bool> fileExistInOld;
+        std::map<std::string, size_t> newSizes;
+        std::map<std::string, size_t> oldSizes;
+        for (auto && fileId : matchingFiles(taskType)) {
+            fileNames.push_back(changesData.newFiles[fileId]);
+            fileExistInOld.push_back(existInOld(fileId));
+            newSizes[fileNames.back()] = newSize(fileId);
+            oldSizes[fileNames.back()] = oldSize(fileId);
+        }
+        auto createTask = [&taskType, &process](const std::vector<std::string> & batch, const std::map<std::string, size_t> & sizes) -> Task * {
+            auto args = prepareArgs(process, batch);
+            auto task = new TaskPstream();
+            if (process.responseFile.size() && argsSize(args) > argsLimit()) {
+                auto responseFile = writeResponseFile(batch);
+                args = prepareArgs(process, std::vector<std::string>{process.responseFile + responseFile});
+                task->addTempFile(responseFile);
+            }
+            task->setProgram(process.executable, args);
+            task->setUseStdIn(false);
+            task->setTimeout(process.timeout);
+            task->setSlots(process.slots);
+            task->setCgroupLimits(process.cgroupLimits);
+            size_t batchSize = 0;
+            for (auto && fileName : batch) {
+                batchSize += sizes.at(fileName);
+            }
+            task->setDesrc(TaskRunDescription{
+                .taskTypeName = taskType.name,
+                .fileName = batch.size() == 1 ? batch.front() : std::to_string(batch.size()) + " files",
+                .inputSize = batchSize,
+            });
+            return task;
+        };
+        size_t fileId = 0;
+        for (auto && batch : splitToBatches(process, fileNames, concurrency())) {
+            std::vector<ProcessingBatch::Entry> entries;
+            if (process.testType == TestType::DIFF_WITH_CHECKOUT) {
+                std::vector<ProcessingBatch::Entry> entriesOld;
+                std::vector<std::string> batchOld;
+                for (auto && fileName : batch) {
+                    auto sharedDiffState = std::make_shared<SharedDiffState>();
+                    entries.push_back({fileName, std::make_unique<ProcessingDiff>(
+                        ProcessingDiff::DiffPart::B, process.logDiffFilterRegex, sharedDiffState
+                    )});
+                    entriesOld.push_back({fileName, std::make_unique<ProcessingDiff>(
+                        ProcessingDiff::DiffPart::A, process.logDiffFilterRegex, sharedDiffState
+                    )});
+                    if (fileExistInOld[fileId++]) {
+                        batchOld.push_back(fileName);
+                    }
+                }
+                Task * taskOld = nullptr;
+                if (batchOld.size()) {
+                    taskOld = createTask(batchOld, oldSizes);
+                } else {
+                    taskOld = new TaskNull();
+                    taskOld->setDesrc(TaskRunDescription{
+                        .taskTypeName = "empty_file",
+                        .fileName = std::to_string(batch.size()) + " files",
+                    });
+                }
+                phases.forOld.push_back(TaskPtr(taskOld));
+                phases.processingForOld.push_back(std::make_unique<ProcessingBatch>(std::move(entriesOld)));
+            } else {
+                for (auto && fileName : batch) {
+                    entries.push_back({fileName, std::unique_ptr<Processing>(createProcessing(process))});
                 }
-                phases.forNew.push_back(TaskPtr(task));
-                phases.processingForNew.push_back(std::unique_ptr<Processing>(processing));
             }
+            phases.forNew.push_back(TaskPtr(createTask(batch, newSizes)));
+            phases.processingForNew.push_back(std::make_unique<ProcessingBatch>(std::move(entries)));
         }
     };
     
     auto forBuild = [&phases](const TaskType & taskType) -> void {
         const auto & process = taskType.process;
-        auto task = new TaskPstream();
-        auto args = prepareArgs(process, "<no file name>");
-        task->setProgram(process.executable, args);
-        task->setDesrc(TaskRunDescription{
-            .taskTypeName = taskType.name,
-            .fileName = "<build>",
-        });
-        task->setUseStdIn(false);
         if (process.useStdin) {
             LogErr("Build cannot use stdin");
             std::exit(1);
         }
-        phases.build.push_back(TaskPtr(task));
-        auto * processing = new ProcessingReturnValue();
-        phases.processingBuild.push_back(std::unique_ptr<Processing>(processing));
+        auto createTask = [&taskType, &process]() -> Task * {
+            auto task = new TaskPstream();
+            auto args = prepareArgs(process, "<no file name>");
+            task->setProgram(process.executable, args);
+            task->setDesrc(TaskRunDescription{
+                .taskTypeName = taskType.name,
+                .fileName = "<build>",
+            });
+            task->setUseStdIn(false);
+            task->setTimeout(process.timeout);
+            task->setSlots(process.slots);
+            task->setCgroupLimits(process.cgroupLimits);
+            return task;
+        };
+        phases.build.push_back(TaskPtr(createTask()));
+        phases.processingBuild.push_back(std::unique_ptr<Processing>(new ProcessingReturnValue()));
+        // both revisions are built at once, each in its own directory
+        phases.buildForOld.push_back(TaskPtr(createTask()));
+        phases.processingBuildForOld.push_back(std::unique_ptr<Processing>(new ProcessingReturnValue()));
     };
     
-    auto forCommitText = [&phases, this](const TaskType & taskType) -> void {
+    // one blob of commit messages for all task types
+    BlobPtr commitsText;
+    auto forCommitText = [&phases, &range, &commitsText, this](const TaskType & taskType) -> void {
         const auto & process = taskType.process;
         auto task = new TaskPstream();
         auto args = prepareArgs(process, "<no file name>");
         task->setProgram(process.executable, args);
+        if (!commitsText) {
+            const std::string & allCommitsText = git->getJoinedCommitMsg(range);
+            LogDev("text: ", allCommitsText);
+            commitsText = makeBlob(allCommitsText);
+        }
         task->setDesrc(TaskRunDescription{
             .taskTypeName = taskType.name,
             .fileName = "<build>",
+            .inputSize = commitsText->size(),
         });
         task->setUseStdIn(true);
-        std::string allCommitsText = git->getJoinedCommitMsg(config.localSha, config.remoteSha);
-        LogDev("text: ", allCommitsText);
-        task->setFileContent(allCommitsText);
+        task->setTimeout(process.timeout);
+        task->setSlots(process.slots);
+        task->setCgroupLimits(process.cgroupLimits);
+        task->setFileContent(commitsText);
         Processing * processing;
         switch (process.testType) {
             case TestType::DIFF: [[fallthrough]];
@@ -236,8 +704,56 @@ TaskPhases TasksCreator::create() {
         phases.processingForNew.push_back(std::unique_ptr<Processing>(processing));
     };
 
+    auto typeDependency = typeDependencies(taskTypes);
+    auto withoutWorktreeTypes = typesWithoutWorktree(taskTypes, typeDependency);
+    // tasks of these types start while changes are still read
+    std::set<std::string> streamedTypes;
+    if (stream) {
+        for (auto && name : withoutWorktreeTypes) {
+            const auto & taskType = taskTypes.at(name);
+            bool perFile = taskType.targetType == TaskType::TargetType::FILE
+                || taskType.targetType == TaskType::TargetType::ADDED_TEXT
+                || taskType.targetType == TaskType::TargetType::FILE_NAME;
+            if (perFile && !taskType.process.isBatch() && typeDependency[name].empty()) {
+                streamedTypes.insert(name);
+            }
+        }
+        for (auto && item : typeDependency) {
+            for (auto && dependency : item.second) {
+                streamedTypes.erase(dependency);
+            }
+        }
+    }
+    git->forEachChangedFile(range, [&](ChangedFile && file) {
+        int fileId = addFile(std::move(file));
+        for (auto && name : streamedTypes) {
+            const auto & taskType = taskTypes.at(name);
+            if (!fileMatches(taskType, fileId)) {
+                continue;
+            }
+            size_t first = phases.forNew.size();
+            forFile(taskType, fileId);
+            for (size_t i = first; i < phases.forNew.size(); i++) {
+                stream(std::move(phases.forNew[i]), std::move(phases.processingForNew[i]));
+            }
+            phases.forNew.resize(first);
+            phases.processingForNew.resize(first);
+        }
+    });
+    // sizes mark it as present in both revisions, its content is empty
+    ChangedFile anyChange;
+    anyChange.name = "___any_change___";
+    anyChange.newSize = 1;
+    anyChange.oldSize = 1;
+    // only ANY_CHANGE types match it
+    changedByExt["___any_change___"].push_back(addFile(std::move(anyChange), false));
+
+    // task type of every created task, for dependencies
+    std::vector<std::string> buildTypes;
+    std::vector<std::string> oldTypes;
+    std::vector<std::string> newTypes;
     for (auto && taskType : taskTypes) {
-        if (!taskType.second.enabled) {
+        if (!taskType.second.enabled || streamedTypes.count(taskType.first)) {
             continue;
         }
         switch (taskType.second.targetType) {
@@ -250,7 +766,11 @@ TaskPhases TasksCreator::create() {
             case TaskType::TargetType::FILE: [[fallthrough]];
             case TaskType::TargetType::ADDED_TEXT: [[fallthrough]];
             case TaskType::TargetType::FILE_NAME:
-                forEachFile(taskType.second);
+                if (taskType.second.process.isBatch()) {
+                    forBatch(taskType.second);
+                } else {
+                    forEachFile(taskType.second);
+                }
                 break;
             case TaskType::TargetType::BUILD:
                 forBuild(taskType.second);
@@ -259,6 +779,55 @@ TaskPhases TasksCreator::create() {
                 forCommitText(taskType.second);
                 break;
         }
+        buildTypes.resize(phases.build.size(), taskType.first);
+        oldTypes.resize(phases.forOld.size(), taskType.first);
+        newTypes.resize(phases.forNew.size(), taskType.first);
     }
+
+    // stdin fed tasks of new revision do not wait for checkout
+    std::vector<std::string> withoutWorktreeTasksTypes;
+    {
+        Tasks forNew;
+        std::vector<std::unique_ptr<Processing>> processingForNew;
+        std::vector<std::string> forNewTypes;
+        for (size_t i = 0; i < phases.forNew.size(); i++) {
+            if (withoutWorktreeTypes.count(newTypes[i])) {
+                phases.withoutWorktree.push_back(std::move(phases.forNew[i]));
+                phases.processingWithoutWorktree.push_back(std::move(phases.processingForNew[i]));
+                withoutWorktreeTasksTypes.push_back(newTypes[i]);
+            } else {
+                forNew.push_back(std::move(phases.forNew[i]));
+                processingForNew.push_back(std::move(phases.processingForNew[i]));
+                forNewTypes.push_back(newTypes[i]);
+            }
+        }
+        phases.forNew = std::move(forNew);
+        phases.processingForNew = std::move(processingForNew);
+        newTypes = std::move(forNewTypes);
+    }
+
+    auto dependencies = [&typeDependency](const std::vector<std::string> & buildTypes, const std::vector<std::string> & phaseTypes) {
+        std::map<std::string, std::vector<size_t>> tasksOfType;
+        for (size_t i = 0; i < buildTypes.size(); i++) {
+            tasksOfType[buildTypes[i]].push_back(i);
+        }
+        for (size_t i = 0; i < phaseTypes.size(); i++) {
+            tasksOfType[phaseTypes[i]].push_back(buildTypes.size() + i);
+        }
+        Dependencies result;
+        for (auto * types : {&buildTypes, &phaseTypes}) {
+            for (auto && typeName : *types) {
+                auto & taskDependencies = result.emplace_back();
+                for (auto && dependency : typeDependency[typeName]) {
+                    const auto & tasks = tasksOfType[dependency];
+                    taskDependencies.insert(taskDependencies.end(), tasks.begin(), tasks.end());
+                }
+            }
+        }
+        return result;
+    };
+    phases.dependsForOld = dependencies(buildTypes, oldTypes);
+    phases.dependsForNew = dependencies(buildTypes, newTypes);
+    phases.dependsWithoutWorktree = dependencies({}, withoutWorktreeTasksTypes);
     return phases;
 }
@@ -21,6 +21,8 @@
 #include "configLoader.h"
 #include "taskBase.h"
 
+#include <functional>
+
 struct CreatorConfig {
     std::string remote;
     std::string url;
@@ -31,14 +33,26 @@ struct CreatorConfig {
 };
 
 using Tasks = std::vector<TaskPtr>;
+/// receives tasks created while changes are still read
+using TaskStream = std::function<void(TaskPtr task, std::unique_ptr<Processing> processing)>;
+/// for every task of one run: indices of tasks finished before it starts, build tasks are numbered first, then tasks of phase
+using Dependencies = std::vector<std::vector<size_t>>;
 
 struct TaskPhases {
     Tasks forOld;
     std::vector<std::unique_ptr<Processing>> processingForOld;
     Tasks build;
     std::vector<std::unique_ptr<Processing>> processingBuild;
+    Tasks buildForOld;              ///< same as build, run in directory of old revision
+    std::vector<std::unique_ptr<Processing>> processingBuildForOld;
     Tasks forNew;
     std::vector<std::unique_ptr<Processing>> processingForNew;
+    Dependencies dependsForOld;     ///< of buildForOld and forOld
+    Dependencies dependsForNew;     ///< of build and forNew
+    /// tasks of new revision reading only stdin, with their dependencies, run while other revision is checked out
+    Tasks withoutWorktree;
+    std::vector<std::unique_ptr<Processing>> processingWithoutWorktree;
+    Dependencies dependsWithoutWorktree;    ///< of withoutWorktree only, no build
 };
 
 class TasksCreator {
@@ -50,5 +64,9 @@ public:
         taskTypes = loadTaskTypeConfig();
         this->git = git;
     };
-    TaskPhases create();
+    /**
+     * @param stream if set, per file tasks of types without worktree and dependencies are passed to it
+     * as soon as their file is read, instead of being returned in phases
+     */
+    TaskPhases create(const TaskStream & stream = nullptr);
 };
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Old revision with a directory where the new one has a file, and back:
+# checkout to its own directory must not use the index of the repository.
+# usage: checkoutTypeChange.sh <git-verify>
+set -e
+verify="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+export XDG_CONFIG_HOME="$dir/config" GIT_CONFIG_NOSYSTEM=1 HOME="$dir"
+export GIT_AUTHOR_NAME=test GIT_AUTHOR_EMAIL=test@test GIT_COMMITTER_NAME=test GIT_COMMITTER_EMAIL=test@test
+cd "$dir"
+git init -q repo
+cd repo
+cat > git-verify.yml <<'YML'
+layout:
+    targetType: FILE_NAME
+    file:
+        ext: [txt]
+    type: PROCESS
+    process:
+        testType: DIFF_WITH_CHECKOUT
+        logDiffFilterRegex: '^$'
+        useStdin: false
+        executable: sh
+        params: ['-c', 'case "$PWD" in *git-verify-old-*) if [ -d thing ]; then cat thing/in; else cat thing; fi > ../../layout;; esac']
+YML
+mkdir thing
+echo dir > thing/in
+echo 1 > a.txt
+git add -A && git commit -qm dir
+git rm -rq thing
+echo file > thing
+echo 2 > a.txt
+git add -A && git commit -qm file
+
+check() {
+    expected="$1"
+    shift
+    rm -f layout
+    "$verify" --no-history "$@"
+    if [ "$(cat layout)" != "$expected" ]; then
+        echo "old revision of $*: expected thing of \"$expected\", got \"$(cat layout)\"" >&2
+        exit 1
+    fi
+}
+# directory in old revision, file in index
+check dir --no-tree-cache HEAD HEAD~1
+check dir HEAD HEAD~1
+# file in old revision made from cached tree with the directory
+check file HEAD~1 HEAD
@@ -0,0 +1,360 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "treeCache.h"
+#include "gitWrapper.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+    /// least recently used trees above it are removed
+    constexpr size_t maxTrees = 4;
+    /// git filemodes
+    constexpr unsigned linkMode = 0120000;
+    constexpr unsigned submoduleMode = 0160000;
+    constexpr unsigned executableBit = 0100;
+    /// tree being written, renamed to tree id when complete
+    const std::string stagingPrefix = "tmp-";
+    /// revision directories in git directory, see TreeCache::createRevisionDir()
+    const std::string revisionDirPrefix = "git-verify-old-";
+
+    [[noreturn]] void fail(const std::string & what, const std::string & path) {
+        throw std::runtime_error("tree cache - " + what + " " + path + ": " + std::strerror(errno));
+    }
+
+    /// exclusive lock of cache, runs at once do not write nor remove trees used by other run
+    class Lock {
+        int fd;
+    public:
+        explicit Lock(const std::string & path) : fd(::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)) {
+            if (fd == -1) {
+                fail("open", path);
+            }
+            while (::flock(fd, LOCK_EX) == -1) {
+                if (errno != EINTR) {
+                    ::close(fd);
+                    fail("lock", path);
+                }
+            }
+        }
+        ~Lock() {
+            ::close(fd);
+        }
+        Lock(const Lock &) = delete;
+        Lock & operator=(const Lock &) = delete;
+    };
+
+    bool isTreeId(const std::string & name) {
+        return name.size() == 40 && name.find_first_not_of("0123456789abcdef") == std::string::npos;
+    }
+
+    long long mtimeNs(const struct stat & fileStat) {
+        return fileStat.st_mtim.tv_sec * 1000000000LL + fileStat.st_mtim.tv_nsec;
+    }
+
+    void writeFile(const std::string & path, const std::string & content, mode_t mode) {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+        if (fd == -1) {
+            fail("create", path);
+        }
+        size_t written = 0;
+        while (written < content.size()) {
+            ssize_t n = ::write(fd, content.data() + written, content.size() - written);
+            if (n <= 0) {
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                ::close(fd);
+                fail("write", path);
+            }
+            written += n;
+        }
+        ::close(fd);
+    }
+
+    /// @return false if filesystem cannot clone, nothing is created then
+    bool cloneFile(const std::string & from, const std::string & to, mode_t mode) {
+#ifdef FICLONE
+        int src = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+        if (src == -1) {
+            fail("open", from);
+        }
+        int dst = ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+        if (dst == -1) {
+            ::close(src);
+            fail("create", to);
+        }
+        bool cloned = ::ioctl(dst, FICLONE, src) == 0;
+        int cloneErrno = errno;
+        ::close(src);
+        ::close(dst);
+        if (!cloned) {
+            ::unlink(to.c_str());
+            if (cloneErrno != EOPNOTSUPP && cloneErrno != EXDEV && cloneErrno != EINVAL && cloneErrno != ENOTTY) {
+                errno = cloneErrno;
+                fail("clone", to);
+            }
+        }
+        return cloned;
+#else
+        (void) from;
+        (void) to;
+        (void) mode;
+        return false;
+#endif
+    }
+
+    enum class Copy {
+        LINK,           ///< within cache, cached files are never written
+        CLONE_OR_LINK,  ///< link only if filesystem cannot clone
+    };
+
+    /// directories and symbolic links are created, regular files are cloned or hard linked
+    void copyTree(const std::string & from, const std::string & to, Copy copy, const std::function<void(const std::string &)> & onLink = {}) {
+        bool canClone = copy == Copy::CLONE_OR_LINK;
+        for (auto it = fs::recursive_directory_iterator(from); it != fs::recursive_directory_iterator(); ++it) {
+            std::string source = it->path().string();
+            std::string target = to + source.substr(from.size());
+            auto status = it->symlink_status();
+            if (fs::is_symlink(status)) {
+                fs::create_symlink(fs::read_symlink(it->path()), target);
+            } else if (fs::is_directory(status)) {
+                fs::create_directory(target);
+            } else {
+                // clones are read-only too, files of revision directory do not depend on filesystem
+                mode_t mode = (status.permissions() & fs::perms::owner_exec) != fs::perms::none ? 0555 : 0444;
+                if (canClone && cloneFile(source, target, mode)) {
+                    continue;
+                }
+                // first failure tells filesystem does not clone
+                canClone = false;
+                if (::link(source.c_str(), target.c_str()) == -1) {
+                    fail("link", target);
+                }
+                if (onLink) {
+                    onLink(target);
+                }
+            }
+        }
+    }
+
+    /// files of checkout are shared by cached trees, writing them in place fails
+    void makeReadOnly(const std::string & dir) {
+        for (auto it = fs::recursive_directory_iterator(dir); it != fs::recursive_directory_iterator(); ++it) {
+            auto status = it->symlink_status();
+            if (fs::is_regular_file(status)) {
+                bool executable = (status.permissions() & fs::perms::owner_exec) != fs::perms::none;
+                fs::permissions(it->path(), executable ? fs::perms(0555) : fs::perms(0444));
+            }
+        }
+    }
+
+    void removeEmptyParents(const std::string & treeDir, fs::path path) {
+        for (path = path.parent_path(); path.string().size() > treeDir.size(); path = path.parent_path()) {
+            if (::rmdir(path.c_str()) == -1) {
+                return;
+            }
+        }
+    }
+
+    /// entry of tree is replaced by its new version, cached files are unlinked, never written
+    void applyChange(GitWrapper & git, const std::string & treeDir, const ChangedFile & file) {
+        std::string path = treeDir + "/" + file.name;
+        std::error_code error;
+        // also directory replaced by file, parent may be already replaced by file
+        fs::remove_all(path, error);
+        if (file.newId.empty()) {
+            // git trees have no empty directories
+            removeEmptyParents(treeDir, path);
+            return;
+        }
+        fs::create_directories(fs::path(path).parent_path());
+        if (file.newMode == submoduleMode) {
+            fs::create_directory(path);
+        } else if (file.newMode == linkMode) {
+            fs::create_symlink(git.readBlob(file.newId), path);
+        } else {
+            writeFile(path, git.readBlobFiltered(file.newId, file.name), file.newMode & executableBit ? 0555 : 0444);
+        }
+    }
+}
+
+TreeCache::TreeCache(GitWrapper & git, std::string directory) : git(git), directory(std::move(directory)) {
+}
+
+TreeCache::~TreeCache() {
+    if (revisionDirFd >= 0) {
+        ::close(revisionDirFd);
+    }
+}
+
+void TreeCache::removeStaleRevisionDirs() {
+    fs::create_directories(directory);
+    // revision directory is created and locked under the same lock
+    Lock lock(directory + "lock");
+    std::error_code error;
+    for (auto && entry : fs::directory_iterator(git.getGitDir(), error)) {
+        if (entry.path().filename().string().rfind(revisionDirPrefix, 0) != 0) {
+            continue;
+        }
+        int fd = ::open(entry.path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        if (::flock(fd, LOCK_EX | LOCK_NB) == 0) {
+            LogInfo("removing ", entry.path().string(), " left by killed run");
+            fs::remove_all(entry.path(), error);
+        }
+        ::close(fd);
+    }
+}
+
+std::string TreeCache::createRevisionDir() {
+    fs::create_directories(directory);
+    Lock lock(directory + "lock");
+    std::string path = git.getGitDir() + revisionDirPrefix + "XXXXXX";
+    if (!::mkdtemp(path.data())) {
+        fail("create", path);
+    }
+    revisionDirFd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (revisionDirFd == -1 || ::flock(revisionDirFd, LOCK_EX) == -1) {
+        fail("lock", path);
+    }
+    return path;
+}
+
+std::string TreeCache::materialize(const std::string & treeId) {
+    std::string treeDir = directory + treeId;
+    if (fs::exists(treeDir)) {
+        return treeDir;
+    }
+    std::string baseDir;
+    std::vector<ChangedFile> changes;
+    for (auto && entry : fs::directory_iterator(directory)) {
+        std::string name = entry.path().filename().string();
+        if (!isTreeId(name)) {
+            continue;
+        }
+        std::vector<ChangedFile> candidate;
+        try {
+            candidate = git.getTreeChanges(name, treeId);
+        } catch (std::runtime_error &) {
+            // tree is not in repository anymore
+            continue;
+        }
+        if (baseDir.empty() || candidate.size() < changes.size()) {
+            baseDir = entry.path().string();
+            changes = std::move(candidate);
+        }
+    }
+    std::string staging = directory + stagingPrefix + "XXXXXX";
+    if (!::mkdtemp(staging.data())) {
+        fail("create", staging);
+    }
+    if (baseDir.empty()) {
+        git.checkoutTo(treeId, staging);
+        makeReadOnly(staging);
+    } else {
+        copyTree(baseDir, staging, Copy::LINK);
+        for (auto && file : changes) {
+            applyChange(git, staging, file);
+        }
+        LogDev("tree ", treeId, " from ", baseDir, ", changed entries: ", changes.size());
+    }
+    fs::rename(staging, treeDir);
+    return treeDir;
+}
+
+void TreeCache::evict(const std::string & keptTreeId) {
+    std::vector<std::pair<fs::file_time_type, fs::path>> trees;
+    for (auto && entry : fs::directory_iterator(directory)) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind(stagingPrefix, 0) == 0) {
+            // left by killed run, nothing else writes while locked
+            std::error_code error;
+            fs::remove_all(entry.path(), error);
+        } else if (isTreeId(name) && name != keptTreeId) {
+            trees.emplace_back(entry.last_write_time(), entry.path());
+        }
+    }
+    if (trees.size() < maxTrees) {
+        return;
+    }
+    std::sort(trees.begin(), trees.end(), [](auto && a, auto && b) {
+        return a.first > b.first;
+    });
+    for (size_t i = maxTrees - 1; i < trees.size(); i++) {
+        std::error_code error;
+        fs::remove_all(trees[i].second, error);
+    }
+}
+
+void TreeCache::checkoutTo(const std::string & revSpec, const std::string & targetDir) {
+    std::string treeId = git.getTreeId(revSpec);
+    fs::create_directories(directory);
+    Lock lock(directory + "lock");
+    std::string treeDir = materialize(treeId);
+    // least recently used is evicted first
+    ::utimensat(AT_FDCWD, treeDir.c_str(), nullptr, 0);
+    evict(treeId);
+    linkedFiles.clear();
+    copyTree(treeDir, targetDir, Copy::CLONE_OR_LINK, [this](const std::string & path) {
+        struct stat fileStat;
+        if (::lstat(path.c_str(), &fileStat)) {
+            fail("stat", path);
+        }
+        linkedFiles.push_back(LinkedFile{path, fileStat.st_ino, fileStat.st_size, mtimeNs(fileStat), fileStat.st_mode});
+    });
+}
+
+void TreeCache::verify(const std::string & targetDir) {
+    for (auto && file : linkedFiles) {
+        struct stat fileStat;
+        // replaced file is not linked anymore
+        if (::lstat(file.path.c_str(), &fileStat) || fileStat.st_ino != file.inode
+            || (fileStat.st_size == file.size && mtimeNs(fileStat) == file.mtimeNs && fileStat.st_mode == file.mode)) {
+            continue;
+        }
+        LogErr("file ", file.path.substr(targetDir.size() + 1), " of old revision was changed in place, tree cache is removed");
+        Lock lock(directory + "lock");
+        std::error_code error;
+        for (auto && entry : fs::directory_iterator(directory, error)) {
+            if (entry.path().filename() != "lock") {
+                fs::remove_all(entry.path(), error);
+            }
+        }
+        break;
+    }
+    linkedFiles.clear();
+}
@@ -0,0 +1,66 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+class GitWrapper;
+
+/**
+ * Trees of earlier runs kept written out in git directory, one directory per tree id.
+ * Missing tree is made from cached tree with the fewest differing entries, only those are written,
+ * others are hard links to read-only files shared by cached trees.
+ * Revision directory gets clones (reflinks) of cached files, or hard links where filesystem cannot clone,
+ * both read-only.
+ */
+class TreeCache {
+    GitWrapper & git;
+    std::string directory;  ///< with trailing slash
+    /// hard link of last checkout, file timestamps are too coarse to compare with time of checkout
+    struct LinkedFile {
+        std::string path;
+        unsigned long inode = 0;
+        long long size = 0;
+        long long mtimeNs = 0;
+        unsigned mode = 0;      ///< chmod of link changes the cached file
+    };
+    std::vector<LinkedFile> linkedFiles;
+    int revisionDirFd = -1;     ///< locked while revision directory is used
+
+    std::string materialize(const std::string & treeId);
+    void evict(const std::string & keptTreeId);
+public:
+    /// directory is created on first checkout
+    TreeCache(GitWrapper & git, std::string directory);
+    ~TreeCache();
+    TreeCache(const TreeCache &) = delete;
+    TreeCache & operator=(const TreeCache &) = delete;
+    /// revision directories of killed runs, not locked by any run, are removed
+    void removeStaleRevisionDirs();
+    /// empty directory for old revision in git directory, locked until this is destroyed
+    std::string createRevisionDir();
+    /// files of revision in empty directory, as GitWrapper::checkoutTo()
+    void checkoutTo(const std::string & revSpec, const std::string & targetDir);
+    /**
+     * Drops whole cache if a hard linked file of revision directory was written in place or its mode changed.
+     * Called before revision directory is removed.
+     */
+    void verify(const std::string & targetDir);
+};
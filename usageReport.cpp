@@ -0,0 +1,112 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "usageReport.h"
+#include "log.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+namespace {
+    constexpr double blockMiB = 512.0 / (1024 * 1024);
+
+    const char * runStatusName(RunStatus runStatus) {
+        switch (runStatus) {
+            case RunStatus::TIMEOUT:
+                return "TIMEOUT";
+            case RunStatus::OOM_KILLED:
+                return "OOM_KILLED";
+            case RunStatus::CANCELLED:
+                return "CANCELLED";
+            case RunStatus::EXITED:
+                break;
+        }
+        return "EXITED";
+    }
+}
+
+void printUsageSummary(const std::vector<UsageRecord> & records) {
+    if (records.empty()) {
+        return;
+    }
+    struct Sum {
+        std::string name;
+        unsigned count = 0;
+        double wall = 0;
+        double maxWall = 0;
+        double user = 0;
+        double system = 0;
+        long maxRssKiB = 0;
+        long inBlocks = 0;
+        long outBlocks = 0;
+    };
+    std::map<std::string, Sum> byType;
+    for (auto && record : records) {
+        auto & sum = byType[record.descr.taskTypeName];
+        sum.name = record.descr.taskTypeName;
+        sum.count++;
+        sum.wall += record.usage.wallSeconds;
+        sum.maxWall = std::max(sum.maxWall, record.usage.wallSeconds);
+        sum.user += record.usage.userSeconds;
+        sum.system += record.usage.systemSeconds;
+        sum.maxRssKiB = std::max(sum.maxRssKiB, record.usage.maxRssKiB);
+        sum.inBlocks += record.usage.inBlocks;
+        sum.outBlocks += record.usage.outBlocks;
+    }
+    std::vector<Sum> sums;
+    for (auto && item : byType) {
+        sums.push_back(item.second);
+    }
+    std::sort(sums.begin(), sums.end(), [](const Sum & a, const Sum & b) {
+        return a.user + a.system > b.user + b.system;
+    });
+    size_t nameWidth = 4;
+    for (auto && sum : sums) {
+        nameWidth = std::max(nameWidth, sum.name.size());
+    }
+    std::ostringstream table;
+    table << std::fixed << std::setprecision(2);
+    table << std::left << std::setw(nameWidth) << "task" << std::right
+        << std::setw(7) << "count" << std::setw(10) << "wall s" << std::setw(10) << "max s"
+        << std::setw(10) << "user s" << std::setw(10) << "sys s" << std::setw(10) << "RSS MiB"
+        << std::setw(10) << "read MiB" << std::setw(10) << "write MiB" << '\n';
+    for (auto && sum : sums) {
+        table << std::left << std::setw(nameWidth) << sum.name << std::right
+            << std::setw(7) << sum.count << std::setw(10) << sum.wall << std::setw(10) << sum.maxWall
+            << std::setw(10) << sum.user << std::setw(10) << sum.system << std::setw(10) << sum.maxRssKiB / 1024.0
+            << std::setw(10) << sum.inBlocks * blockMiB << std::setw(10) << sum.outBlocks * blockMiB << '\n';
+    }
+    LogInfo("resource usage:\n", table.str());
+}
+
+bool writeUsageReport(const std::string & fileName, const std::vector<UsageRecord> & records) {
+    std::ofstream report(fileName);
+    report << "phase\ttask\tfile\tstatus\trun\twall_s\tuser_s\tsys_s\tmax_rss_kib\tin_blocks\tout_blocks\n";
+    for (auto && record : records) {
+        const auto & usage = record.usage;
+        report << record.phase << '\t' << record.descr.taskTypeName << '\t' << record.descr.fileName << '\t'
+            << record.status << '\t' << runStatusName(record.runStatus) << '\t'
+            << usage.wallSeconds << '\t' << usage.userSeconds << '\t' << usage.systemSeconds << '\t'
+            << usage.maxRssKiB << '\t' << usage.inBlocks << '\t' << usage.outBlocks << '\n';
+    }
+    report.close();
+    return !report.fail();
+}
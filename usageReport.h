@@ -0,0 +1,41 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "taskBase.h"
+#include "process.h"
+
+#include <string>
+#include <vector>
+
+/// resources used by one finished task
+struct UsageRecord {
+    std::string phase;      ///< "build", "old", "new" or "stdin" (new revision without worktree)
+    TaskRunDescription descr;
+    ResourceUsage usage;
+    int status = -1;
+    RunStatus runStatus = RunStatus::EXITED;
+};
+
+/// table of resources used per task type, most CPU consuming first
+void printUsageSummary(const std::vector<UsageRecord> & records);
+
+/// one tab separated line per task with header line, for external reporting
+/// @return false if file cannot be written
+bool writeUsageReport(const std::string & fileName, const std::vector<UsageRecord> & records);
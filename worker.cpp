@@ -0,0 +1,293 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "worker.h"
+#include "log.h"
+
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace {
+    /// cumulative usage of running process from /proc, worker requests are accounted by difference
+    ResourceUsage procUsage(pid_t pid) {
+        ResourceUsage usage;
+        const std::string dir = "/proc/" + std::to_string(pid);
+        std::ifstream stat(dir + "/stat");
+        std::string line;
+        if (std::getline(stat, line) && line.rfind(')') != std::string::npos) {
+            // fields after "(comm)": state is field 3, utime 14, stime 15, cutime 16, cstime 17
+            std::istringstream fields(line.substr(line.rfind(')') + 2));
+            std::string field;
+            double ticks[4] = {};
+            for (int i = 3; i <= 17 && fields >> field; i++) {
+                if (i >= 14) {
+                    ticks[i - 14] = std::stod(field);
+                }
+            }
+            double ticksPerSecond = ::sysconf(_SC_CLK_TCK);
+            usage.userSeconds = (ticks[0] + ticks[2]) / ticksPerSecond;
+            usage.systemSeconds = (ticks[1] + ticks[3]) / ticksPerSecond;
+        }
+        std::ifstream status(dir + "/status");
+        while (std::getline(status, line)) {
+            if (line.rfind("VmHWM:", 0) == 0) {
+                usage.maxRssKiB = std::stol(line.substr(6));
+            }
+        }
+        std::ifstream io(dir + "/io");
+        while (std::getline(io, line)) {
+            if (line.rfind("read_bytes:", 0) == 0) {
+                usage.inBlocks = std::stol(line.substr(11)) / 512;
+            } else if (line.rfind("write_bytes:", 0) == 0) {
+                usage.outBlocks = std::stol(line.substr(12)) / 512;
+            }
+        }
+        return usage;
+    }
+}
+
+class WorkerPool::Worker {
+    const WorkerPool & pool;
+    ChildProcessPtr process;
+    TaskCgroupPtr cgroup;
+    bool running = false;
+
+    bool ensureRunning() {
+        if (running) {
+            return true;
+        }
+        process = createChildProcess();
+        cgroup = createTaskCgroup(pool.typeName, pool.cgroupLimits);
+        if (cgroup) {
+            process->setCgroup(cgroup->path());
+        }
+        process->setEnvironment(pool.environment);
+        running = process->start(pool.programName, pool.args, true);
+        if (running) {
+            for (int fd : {process->inFd(), process->outFd(), process->errFd()}) {
+                setNonBlocking(fd);
+            }
+        } else {
+            LogErr("cannot start worker \"", pool.programName, "\": ", std::strerror(process->error()));
+            process->wait();
+            cgroup.reset();
+        }
+        return running;
+    }
+
+    static constexpr long incompleteHeader = -1;
+    static constexpr long malformedHeader = -2;
+
+    /// @return line count from response header, incompleteHeader or malformedHeader
+    static long responseSize(const Messages & lines, int & status) {
+        if (lines.empty()) {
+            return incompleteHeader;
+        }
+        std::istringstream header(lines.begin()->second);
+        long count = 0;
+        std::string rest;
+        if (!(header >> status >> count) || count < 0 || header >> rest) {
+            status = 1;
+            return malformedHeader;
+        }
+        return count;
+    }
+public:
+    explicit Worker(const WorkerPool & pool) : pool(pool) {}
+    ~Worker() {
+        stop();
+    }
+
+    void start() {
+        ensureRunning();
+    }
+
+    void stop() {
+        if (running) {
+            running = false;
+            process->wait();
+            cgroup.reset();
+        }
+    }
+
+    ProcessResult request(const std::string & path, std::string_view content, double timeout) {
+        RunStatus notStarted = notStartedStatus();
+        if (notStarted != RunStatus::EXITED) {
+            return {1, {}, notStarted, {}};
+        }
+        auto deadline = deadlineAfter(timeout);
+        if (!ensureRunning()) {
+            return {1, {{MessageType::ERR, "worker \"" + pool.programName + "\" not running"}}, RunStatus::EXITED, {}};
+        }
+        auto runStatus = RunStatus::EXITED;
+        auto startTime = Clock::now();
+        auto startUsage = procUsage(process->pid());
+        const std::string header = path + '\n' + std::to_string(content.size()) + '\n';
+        struct Part { std::string_view data; size_t written; } parts[] = {{header, 0}, {content, 0}};
+        size_t partId = 0;
+        LineReader out(MessageType::NORMAL);
+        LineReader err(MessageType::ERR);
+        int status = 1;
+        long count = incompleteHeader;
+        while (count == incompleteHeader || (count >= 0 && static_cast<long>(out.msgs.size()) <= count)) {
+            while (partId < 2 && parts[partId].written == parts[partId].data.size()) {
+                partId++;
+            }
+            if (processesCancelled()) {
+                runStatus = RunStatus::CANCELLED;
+                terminateProcessGroup(*process);
+                break;
+            }
+            int timeoutMs = -1;
+            if (deadline != Clock::time_point::max()) {
+                auto now = Clock::now();
+                if (now >= deadline) {
+                    runStatus = RunStatus::TIMEOUT;
+                    terminateProcessGroup(*process);
+                    break;
+                }
+                timeoutMs = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+            }
+            enum { IN, OUT, ERR, CANCEL, COUNT };
+            pollfd fds[COUNT] = {
+                {partId < 2 ? process->inFd() : -1, POLLOUT, 0},
+                {process->outFd(), POLLIN, 0},
+                {process->errFd(), POLLIN, 0},
+                {cancelEventFd(), POLLIN, 0},
+            };
+            if (::poll(fds, COUNT, timeoutMs) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            if (fds[IN].revents) {
+                auto & part = parts[partId];
+                ssize_t n = writeNoSigpipe(process->inFd(), part.data.data() + part.written, part.data.size() - part.written);
+                if (n > 0) {
+                    part.written += n;
+                } else if (errno != EAGAIN && errno != EINTR) {
+                    break;
+                }
+            }
+            if (fds[ERR].revents) {
+                err.read(process->errFd());
+            }
+            if (fds[OUT].revents) {
+                out.read(process->outFd());
+                if (out.eof) {
+                    break;
+                }
+                count = responseSize(out.msgs, status);
+            }
+        }
+        while (err.read(process->errFd())) {}
+        err.finish();
+        Messages msgs;
+        // stream of worker is out of sync with requests, it is killed and started again
+        bool restart = false;
+        bool complete = count >= 0 && static_cast<long>(out.msgs.size()) > count;
+        if (complete && (static_cast<long>(out.msgs.size()) > count + 1 || out.hasUnfinished())) {
+            // more output than announced, next request would read the rest
+            status = 1;
+            msgs = std::move(out.msgs);
+            msgs.push_back({MessageType::ERR, "worker \"" + pool.programName + "\" sent more lines than announced, restarted"});
+            restart = true;
+        } else if (complete) {
+            // skip header
+            auto it = out.msgs.begin();
+            for (++it; count > 0; ++it, count--) {
+                msgs.push_back(*it);
+            }
+        } else if (count == malformedHeader) {
+            msgs = std::move(out.msgs);
+            msgs.push_back({MessageType::ERR, "worker \"" + pool.programName + "\" sent malformed response header, restarted"});
+            restart = true;
+        } else {
+            status = 1;
+            if (runStatus == RunStatus::EXITED && cgroup && cgroup->oomKilled()) {
+                runStatus = RunStatus::OOM_KILLED;
+            }
+            msgs = std::move(out.msgs);
+            msgs.push_back({MessageType::ERR, "worker \"" + pool.programName + (runStatus == RunStatus::EXITED ? "\" exited during request" : "\" killed")});
+            stop();
+        }
+        if (restart) {
+            terminateProcessGroup(*process);
+            stop();
+        }
+        msgs.append(std::move(err.msgs));
+        // worker exited: its final usage is known from wait()
+        auto usage = running ? procUsage(process->pid()) : process->usage();
+        usage.wallSeconds = std::chrono::duration<double>(Clock::now() - startTime).count();
+        usage.userSeconds = std::max(0.0, usage.userSeconds - startUsage.userSeconds);
+        usage.systemSeconds = std::max(0.0, usage.systemSeconds - startUsage.systemSeconds);
+        usage.inBlocks = std::max(0L, usage.inBlocks - startUsage.inBlocks);
+        usage.outBlocks = std::max(0L, usage.outBlocks - startUsage.outBlocks);
+        if (restart) {
+            ensureRunning();
+        }
+        return {status, std::move(msgs), runStatus, usage};
+    }
+};
+
+WorkerPool::WorkerPool(const std::string & programName, const std::vector<std::string> & args, unsigned size)
+    : programName(programName), args(args) {
+    for (unsigned i = 0; i < std::max(size, 1u); i++) {
+        workers.push_back(std::make_unique<Worker>(*this));
+        idle.push_back(workers.back().get());
+    }
+}
+
+WorkerPool::~WorkerPool() = default;
+
+void WorkerPool::setCgroupLimits(const std::string & typeName, const CgroupLimits & limits) {
+    this->typeName = typeName;
+    cgroupLimits = limits;
+}
+
+void WorkerPool::setEnvironment(const std::vector<std::string> & environment) {
+    this->environment = environment;
+}
+
+void WorkerPool::start() {
+    for (auto && worker : workers) {
+        worker->start();
+    }
+}
+
+ProcessResult WorkerPool::request(const std::string & path, std::string_view content, double timeout) {
+    Worker * worker = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idleChanged.wait(lock, [this]{ return !idle.empty(); });
+        worker = idle.back();
+        idle.pop_back();
+    }
+    auto result = worker->request(path, content, timeout);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.push_back(worker);
+    }
+    idleChanged.notify_one();
+    return result;
+}
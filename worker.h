@@ -0,0 +1,65 @@
+/*
+    This file is part of git-verify.
+    Copyright (C) 2019  Grzegorz Wójcik
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "messages.h"
+#include "process.h"
+#include "cgroup.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Long-lived tool processes of one task type, reused for all files in the run.
+ *
+ * Request, written to worker stdin:
+ *     <path>\n<content length>\n<content>
+ * Response, read from worker stdout:
+ *     <status> <line count>\n<line>\n...
+ * stderr of worker is attached to the current request.
+ */
+class WorkerPool {
+    class Worker;
+
+    std::string programName;
+    std::vector<std::string> args;
+    std::string typeName;
+    CgroupLimits cgroupLimits;
+    std::vector<std::string> environment;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<Worker*> idle;
+    std::mutex mutex;
+    std::condition_variable idleChanged;
+public:
+    WorkerPool(const std::string & programName, const std::vector<std::string> & args, unsigned size);
+    ~WorkerPool();
+    /// each worker runs in own cgroup, set before start()
+    void setCgroupLimits(const std::string & typeName, const CgroupLimits & limits);
+    /// "NAME=value" added to environment of workers, set before start()
+    void setEnvironment(const std::vector<std::string> & environment);
+    /// start all workers, they initialize while other work is done
+    void start();
+    /**
+     * Waits for idle worker, timeout counts from then. Worker is killed and restarted on next request when deadline passes.
+     * @param timeout seconds, 0 - only global deadline
+     */
+    ProcessResult request(const std::string & path, std::string_view content, double timeout);
+};